@@ -305,6 +305,186 @@ void test(int num_elements, int iterations, bool preallocate,
   }
 }
 
+// measures ptree_get_many against a loop of ptree_get_it on batches of random
+// keys, whose lookups have nothing in common but can overlap their cache misses
+void test_batches(int num_elements, int batch_size, int iterations,
+                  bool details) {
+
+  profiler tree_access = profiler("ptree_get_it access");
+  profiler tree_batch = profiler("ptree_get_many access");
+
+  int randomness = 3;
+  random_int_generator rng = random_int_generator(randomness * num_elements);
+
+  vector<simple_obj> objs;
+  objs.reserve(num_elements);
+  for (int i = 0; i < num_elements; ++i) {
+    objs.push_back(simple_obj());
+    objs.back().key = rng.next();
+  }
+
+  auto t = ptree_new__simple_obj(cmp_simple_obj, key_cmp_simple_obj,
+                                 num_elements);
+  for (int i = 0; i < num_elements; ++i) {
+    ptree_insert__simple_obj(t, &objs[i]);
+  }
+
+  vector<int> keys(batch_size);
+  vector<const int *> key_ptrs(batch_size);
+  vector<simple_obj *> out(batch_size);
+
+  for (int n = 0; n < iterations; ++n) {
+    for (int i = 0; i < batch_size; ++i) {
+      keys[i] = rng.next();
+      key_ptrs[i] = &keys[i];
+    }
+
+    int acc_access = 0;
+    int acc_batch = 0;
+
+    // the batch that runs second finds the nodes in the cache, so the order
+    // alternates
+    for (int pass = 0; pass < 2; ++pass) {
+      if ((pass + n) % 2) {
+        tree_batch.start();
+        ptree_get_many__simple_obj(t, key_ptrs.data(), batch_size,
+                                   out.data());
+        tree_batch.end();
+        for (int i = 0; i < batch_size; ++i) {
+          if (out[i]) {
+            acc_batch += out[i]->key;
+          }
+        }
+      } else {
+        tree_access.start();
+        for (int i = 0; i < batch_size; ++i) {
+          auto x = ptree_get_it__simple_obj(t, &keys[i]);
+          if (x) {
+            acc_access += x->ptr->key;
+          }
+        }
+        tree_access.end();
+      }
+    }
+
+    if (acc_access != acc_batch) {
+      fprintf(stderr, "Coeherence Error\n");
+    }
+  }
+
+  ptree_free__simple_obj(t);
+
+  cout << "----------------------------------------" << endl;
+  cout << num_elements << " random elements, batches of " << batch_size
+       << " random keys and " << iterations << " measurements:" << endl
+       << endl;
+
+  tree_access.compute();
+  tree_batch.compute();
+
+  auto ratio = 100. * tree_batch.get_mean() / tree_access.get_mean();
+  cout << "BATCH ACCESS time of ptree_get_many = " << (int)ratio
+       << "% of ptree_get_it's ";
+  cout << scientific << tree_access.get_mean() / 1E9 << " s" << endl << endl;
+
+  if (details) {
+    cout << "DETAILS:" << endl << endl;
+    tree_access.print();
+    tree_batch.print();
+  }
+}
+
+// measures ptree_get_many_sorted against a loop of ptree_get on batches of
+// consecutive keys, the dense sorted batches for which each lookup of
+// ptree_get_many_sorted only climbs a few levels from the previous one
+void test_sorted_batches(int num_elements, int batch_size, int iterations,
+                         bool details) {
+
+  profiler tree_access = profiler("ptree_get access");
+  profiler tree_batch = profiler("ptree_get_many_sorted access");
+
+  int randomness = 3;
+  random_int_generator rng = random_int_generator(randomness * num_elements);
+
+  vector<simple_obj> objs;
+  objs.reserve(num_elements);
+  for (int i = 0; i < num_elements; ++i) {
+    objs.push_back(simple_obj());
+    objs.back().key = rng.next();
+  }
+
+  auto t = ptree_new__simple_obj(cmp_simple_obj, key_cmp_simple_obj,
+                                 num_elements);
+  for (int i = 0; i < num_elements; ++i) {
+    ptree_insert__simple_obj(t, &objs[i]);
+  }
+
+  vector<int> keys(batch_size);
+  vector<const int *> key_ptrs(batch_size);
+  vector<simple_obj *> out(batch_size);
+
+  for (int n = 0; n < iterations; ++n) {
+    int first_key = rng.next() % (randomness * num_elements - batch_size + 1);
+    for (int i = 0; i < batch_size; ++i) {
+      keys[i] = first_key + i;
+      key_ptrs[i] = &keys[i];
+    }
+
+    int acc_access = 0;
+    int acc_batch = 0;
+
+    // the batch that runs second finds the nodes in the cache, so the order
+    // alternates
+    for (int pass = 0; pass < 2; ++pass) {
+      if ((pass + n) % 2) {
+        tree_batch.start();
+        ptree_get_many_sorted__simple_obj(t, key_ptrs.data(), batch_size,
+                                          out.data());
+        tree_batch.end();
+        for (int i = 0; i < batch_size; ++i) {
+          if (out[i]) {
+            acc_batch += out[i]->key;
+          }
+        }
+      } else {
+        tree_access.start();
+        for (int i = 0; i < batch_size; ++i) {
+          auto x = ptree_get__simple_obj(t, &keys[i]);
+          if (x) {
+            acc_access += x->key;
+          }
+        }
+        tree_access.end();
+      }
+    }
+
+    if (acc_access != acc_batch) {
+      fprintf(stderr, "Coeherence Error\n");
+    }
+  }
+
+  ptree_free__simple_obj(t);
+
+  cout << "----------------------------------------" << endl;
+  cout << num_elements << " random elements, batches of " << batch_size
+       << " consecutive keys and " << iterations << " measurements:" << endl
+       << endl;
+
+  tree_access.compute();
+  tree_batch.compute();
+
+  auto ratio = 100. * tree_batch.get_mean() / tree_access.get_mean();
+  cout << "SORTED BATCH ACCESS time of ptree_get_many_sorted = " << (int)ratio
+       << "% of ptree_get's ";
+  cout << scientific << tree_access.get_mean() / 1E9 << " s" << endl << endl;
+
+  if (details) {
+    cout << "DETAILS:" << endl << endl;
+    tree_access.print();
+    tree_batch.print();
+  }
+}
+
 int main(int argc, char *argv[]) {
   cout.precision(2);
   bool details = false;
@@ -315,6 +495,8 @@ int main(int argc, char *argv[]) {
   }
 
   cout << "ptree benchmark program start" << endl << endl;
+  cout << "PTREE_THREADED is: " << (PTREE_THREADED ? "ON" : "OFF") << endl
+       << endl;
 
   for (int preallocate = 1; preallocate > -1; --preallocate) {
     cout << "========================================" << endl;
@@ -328,6 +510,24 @@ int main(int argc, char *argv[]) {
     cout << endl;
   }
 
+  cout << "========================================" << endl;
+  cout << "batches of lookups" << endl;
+  cout << "========================================" << endl << endl << endl;
+  for (int i = 4; i <= 6; ++i) {
+    int num_elements = pow(10, i);
+    test_batches(num_elements, 4096, 100, details);
+  }
+  cout << endl;
+
+  cout << "========================================" << endl;
+  cout << "sorted batches of lookups" << endl;
+  cout << "========================================" << endl << endl << endl;
+  for (int i = 4; i <= 6; ++i) {
+    int num_elements = pow(10, i);
+    test_sorted_batches(num_elements, 4096, 100, details);
+  }
+  cout << endl;
+
   cout << "ptree benchmark program end" << endl;
 
   cin.get();
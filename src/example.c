@@ -146,6 +146,21 @@ int main(int argc, char **argv) {
   }
   printf("\n");
 
+  // iterate in order the union of many trees with the same ordering, without
+  // copying their elements
+  vec3 origin = {{0.f, 0.f, 0.f}};
+  ptree_of_vec3 *u = ptree_new__vec3(cmp_vec3, key_cmp_vec3, 1);
+  ptree_insert__vec3(u, &origin);
+  ptree_of_vec3 *trees[2] = {t, u};
+  ptree_merge *merge = ptree_merge_new__vec3(trees, 2, 0);
+  vec3 *merged;
+  while ((merged = ptree_merge_next__vec3(merge))) {
+    printf("%f %f %f\n", merged->xyz[0], merged->xyz[1], merged->xyz[2]);
+  }
+  printf("\n");
+  ptree_merge_free(merge);
+  ptree_free__vec3(u);
+
   // let's clean up,
   // ptree does not manage its element, so to free them, you have to iterate the
   // tree
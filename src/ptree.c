@@ -43,6 +43,15 @@ typedef int bool;
 
 #define oom() abort()
 
+#if defined(__GNUC__) || defined(__clang__)
+#define prefetch(addr) __builtin_prefetch(addr)
+#elif defined(_MSC_VER)
+#include <xmmintrin.h>
+#define prefetch(addr) _mm_prefetch((const char *)(addr), _MM_HINT_T0)
+#else
+#define prefetch(addr)
+#endif
+
 #if (PTREE_STORAGE_64BIT == 1)
 typedef uint64_t ptree_size_int;
 #else
@@ -56,19 +65,75 @@ typedef uint32_t ptree_size_int;
 typedef struct ptree_node {
   void *ptr;
   struct ptree_node *links[2];
+#if (PTREE_NO_PARENT_POINTERS == 0)
   struct ptree_node *parent;
+#endif
+#if (PTREE_THREADED == 1)
+  // the previous and the next node in order, NULL at the ends
+  struct ptree_node *threads[2];
+#endif
   ptree_size_int flags;
 } ptree_node;
 
 struct ptree {
   ptree_node *root;
+  // the inorder minimum and maximum nodes, NULL if the tree is empty
+  ptree_node *min;
+  ptree_node *max;
   ptree_size_int nodes_num;
   ptree_size_int allocated_nodes_num;
+  // the nodes, the ones in the tree first, and the size of the array
   ptree_node **nodes;
+  ptree_size_int nodes_capacity;
   ptree_cmp_fptr cmp;
   ptree_cmp_fptr cmp_key;
+  // if set, equal elements are allowed, and each one is inserted after the
+  // elements equal to it
+  bool multiset;
+  // if not 0, the maximum number of elements, above which the maximum element,
+  // if evict_max is set, or else the minimum one, is removed
+  size_t capacity;
+  bool evict_max;
+  // the last accessed node, used as starting point for searches if use_finger
+  // is set. Searches update it also on const trees.
+  ptree_node *finger;
+  bool use_finger;
+  // optional direct-mapped cache from key hashes to nodes, used by
+  // ptree_get_it. An entry is valid only while its node is still at the same
+  // index among the nodes in use by the tree, which invalidates the entries of
+  // removed and extracted nodes.
+  struct ptree_cache_entry *cache;
+  size_t cache_mask;
+  ptree_hash_fptr cache_hash_key;
+  // optional open-addressing hash table from elements to nodes, that holds
+  // all the nodes of the tree, used for exact lookups if hash_elem is set
+  struct ptree_hash_entry *index;
+  size_t index_mask;
+  ptree_hash_fptr hash_elem;
+  ptree_hash_fptr index_hash_key;
+  // optional blocked bloom filter of the elements, with one 64 bit word per
+  // block. Removed elements stay in it until it is rebuilt.
+  uint64_t *bloom;
+  size_t bloom_mask;
+  size_t bloom_capacity;
+  size_t bloom_removed;
+  ptree_hash_fptr bloom_hash_elem;
+  ptree_hash_fptr bloom_hash_key;
 };
 
+typedef struct ptree_hash_entry {
+  uint64_t hash;
+  ptree_node *node;
+} ptree_hash_entry;
+
+typedef struct ptree_cache_entry {
+  uint64_t hash;
+  ptree_node *node;
+  // the index of node in the nodes of the tree, checked before node is
+  // dereferenced, as it may have been extracted and freed
+  ptree_size_int index;
+} ptree_cache_entry;
+
 /******************************************************
  * node flags
  ******************************************************/
@@ -81,8 +146,7 @@ const size_t max_nodes = 9223372036854775807; //(2<<63)-1
 const size_t max_nodes = 2147483647; //(2<<31)-1
 #endif
 
-static ptree_node _leaf = {
-    .ptr = NULL, .links = {NULL, NULL}, .parent = NULL, .flags = 0};
+static ptree_node _leaf = {.ptr = NULL, .links = {NULL, NULL}, .flags = 0};
 #define leaf &_leaf
 
 #define is_red(node) (((node)->flags & red_flag) != 0)
@@ -98,7 +162,7 @@ static ptree_node _leaf = {
 #define set_node_index(node, index)                                            \
   ((node)->flags = index | ((node)->flags & red_flag))
 
-inline static void copy_color(ptree_node *dst, ptree_node *src) {
+inline static void copy_color(ptree_node *dst, const ptree_node *src) {
   if (is_red(src)) {
     paint_red(dst);
   } else {
@@ -110,8 +174,213 @@ inline static void copy_color(ptree_node *dst, ptree_node *src) {
  * itearation
  ******************************************************/
 
+// pushes node and all its descendants in direction dir on the path of the
+// cursor, and returns the last one
+static ptree_it *cursor_descend(ptree_cursor *cursor, ptree_node *node,
+                                int dir) {
+  while (node != leaf) {
+    assert(cursor->depth < PTREE_MAX_HEIGHT);
+    cursor->path[cursor->depth++] = (ptree_it *)node;
+    node = node->links[dir];
+  }
+  return cursor->depth ? cursor->path[cursor->depth - 1] : NULL;
+}
+
+// moves the cursor to the next node in direction dir
+static ptree_it *cursor_step(ptree_cursor *cursor, int dir) {
+  if (cursor->depth == 0) {
+    return NULL;
+  }
+  ptree_node *node = (ptree_node *)cursor->path[cursor->depth - 1];
+  if (has_child(node, dir)) {
+    return cursor_descend(cursor, node->links[dir], !dir);
+  }
+  // climb until coming from the other side
+  do {
+    node = (ptree_node *)cursor->path[--(cursor->depth)];
+  } while (cursor->depth > 0 &&
+           node == ((ptree_node *)cursor->path[cursor->depth - 1])->links[dir]);
+  return cursor->depth ? cursor->path[cursor->depth - 1] : NULL;
+}
+
+// sets the cursor on the first node that is not less than key according to
+// cmp, and returns it, or NULL if there is none
+static ptree_it *cursor_seek(const ptree *tree, ptree_cursor *cursor,
+                             ptree_cmp_fptr cmp, const void *key) {
+  int32_t found = 0;
+  cursor->depth = 0;
+  ptree_node *node = tree->root;
+  while (node != leaf) {
+    assert(cursor->depth < PTREE_MAX_HEIGHT);
+    cursor->path[cursor->depth++] = (ptree_it *)node;
+    if (cmp(key, node->ptr) <= 0) {
+      found = cursor->depth;
+      node = node->links[0];
+    } else {
+      node = node->links[1];
+    }
+  }
+  cursor->depth = found;
+  return found ? cursor->path[found - 1] : NULL;
+}
+
+// like cursor_seek, but key must not be less than the elements before the one
+// the cursor is on, so the cursor only moves forward: it climbs only up to the
+// first ancestor whose right subtree or itself can be not less than key, and
+// descends from there
+static ptree_it *cursor_seek_forward(ptree_cursor *cursor, ptree_cmp_fptr cmp,
+                                     const void *key) {
+  if (cursor->depth == 0) {
+    return NULL;
+  }
+  ptree_node *node = (ptree_node *)cursor->path[cursor->depth - 1];
+  if (cmp(key, node->ptr) <= 0) {
+    return (ptree_it *)node;
+  }
+  // node is less than key, and so is its left subtree, and the ancestors from
+  // whose right subtree the path comes
+  while (cursor->depth > 1) {
+    ptree_node *parent = (ptree_node *)cursor->path[cursor->depth - 2];
+    if (node == parent->links[0] && cmp(key, parent->ptr) <= 0) {
+      break;
+    }
+    --(cursor->depth);
+    node = parent;
+  }
+  // the parent of node, if any, is not less than key, so it is the result
+  // unless the right subtree of node has a node not less than key
+  int32_t found = cursor->depth - 1;
+  node = node->links[1];
+  while (node != leaf) {
+    assert(cursor->depth < PTREE_MAX_HEIGHT);
+    cursor->path[cursor->depth++] = (ptree_it *)node;
+    if (cmp(key, node->ptr) <= 0) {
+      found = cursor->depth;
+      node = node->links[0];
+    } else {
+      node = node->links[1];
+    }
+  }
+  cursor->depth = found;
+  return found ? cursor->path[found - 1] : NULL;
+}
+
+ptree_it *ptree_cursor_min(const ptree *tree, ptree_cursor *cursor) {
+  cursor->depth = 0;
+  return cursor_descend(cursor, tree->root, 0);
+}
+
+ptree_it *ptree_cursor_max(const ptree *tree, ptree_cursor *cursor) {
+  cursor->depth = 0;
+  return cursor_descend(cursor, tree->root, 1);
+}
+
+ptree_it *ptree_cursor_next(ptree_cursor *cursor) {
+  return cursor_step(cursor, 1);
+}
+
+ptree_it *ptree_cursor_prev(ptree_cursor *cursor) {
+  return cursor_step(cursor, 0);
+}
+
+size_t ptree_export(ptree_cursor *cursor, void **buf, size_t n) {
+  size_t count = 0;
+  while (count < n && cursor->depth > 0) {
+    buf[count++] = cursor->path[cursor->depth - 1]->ptr;
+    cursor_step(cursor, 1);
+  }
+  return count;
+}
+
+size_t ptree_export_all(const ptree *tree, void **buf) {
+  ptree_node *stack[PTREE_MAX_HEIGHT];
+  int depth = 0;
+  size_t count = 0;
+  ptree_node *node = tree->root;
+  while (true) {
+    while (node != leaf) {
+      stack[depth++] = node;
+      node = node->links[0];
+    }
+    if (depth == 0) {
+      return count;
+    }
+    node = stack[--depth];
+    buf[count++] = node->ptr;
+    node = node->links[1];
+  }
+}
+
+int ptree_foreach(const ptree *tree, ptree_visit_fptr fn, void *ctx) {
+  ptree_node *stack[PTREE_MAX_HEIGHT];
+  int depth = 0;
+  ptree_node *node = tree->root;
+  while (true) {
+    while (node != leaf) {
+      stack[depth++] = node;
+      node = node->links[0];
+    }
+    if (depth == 0) {
+      return 0;
+    }
+    node = stack[--depth];
+    if (fn(node->ptr, ctx)) {
+      return 1;
+    }
+    node = node->links[1];
+  }
+}
+
+int ptree_foreach_range(const ptree *tree, const void *min_key,
+                        const void *max_key, ptree_visit_fptr fn, void *ctx) {
+  ptree_node *stack[PTREE_MAX_HEIGHT];
+  int depth = 0;
+  ptree_node *node = tree->root;
+  // push the path to the first element not less than min_key, skipping the
+  // nodes that are less than it along with their left subtrees
+  if (min_key) {
+    while (node != leaf) {
+      int diff = tree->cmp_key(min_key, node->ptr);
+      if (diff > 0) {
+        node = node->links[1];
+      } else {
+        stack[depth++] = node;
+        // in a multiset, there may be more elements equal to min_key on the
+        // left
+        if (diff == 0 && !tree->multiset) {
+          break;
+        }
+        node = node->links[0];
+      }
+    }
+    node = leaf;
+  }
+  while (true) {
+    while (node != leaf) {
+      stack[depth++] = node;
+      node = node->links[0];
+    }
+    if (depth == 0) {
+      return 0;
+    }
+    node = stack[--depth];
+    if (max_key && tree->cmp_key(max_key, node->ptr) < 0) {
+      return 0;
+    }
+    if (fn(node->ptr, ctx)) {
+      return 1;
+    }
+    node = node->links[1];
+  }
+}
+
+#if (PTREE_NO_PARENT_POINTERS == 0 || PTREE_THREADED == 1)
+
 static inline ptree_node *get_next_node(ptree_node *node) {
   assert(node && node != leaf);
+#if (PTREE_THREADED == 1)
+  return node->threads[1];
+#else
   if (node->links[1] != leaf) {
     node = node->links[1];
     while (node->links[0] != leaf) {
@@ -126,9 +395,13 @@ static inline ptree_node *get_next_node(ptree_node *node) {
     }
     return it != leaf ? it : NULL;
   }
+#endif
 }
 static inline ptree_node *get_prev_node(ptree_node *node) {
   assert(node && node != leaf);
+#if (PTREE_THREADED == 1)
+  return node->threads[0];
+#else
   if (node->links[0] != leaf) {
     node = node->links[0];
     while (node->links[1] != leaf) {
@@ -143,6 +416,7 @@ static inline ptree_node *get_prev_node(ptree_node *node) {
     }
     return it != leaf ? it : NULL;
   }
+#endif
 }
 
 ptree_it *ptree_it_next(ptree_it *node) {
@@ -153,6 +427,8 @@ ptree_it *ptree_it_prev(ptree_it *node) {
   return (ptree_it *)get_prev_node((ptree_node *)node);
 }
 
+#endif
+
 /******************************************************
  * nodes management
  ******************************************************/
@@ -172,12 +448,15 @@ void ptree_allocate_nodes(ptree *tree, size_t num_nodes) {
   if (nodes_to_reallocate > max_nodes) {
     oom();
   }
-  ptree_node **nodes =
-      realloc(tree->nodes, nodes_to_reallocate * sizeof(ptree_node *));
-  if (!nodes) {
-    oom();
+  if (nodes_to_reallocate > tree->nodes_capacity) {
+    ptree_node **nodes =
+        realloc(tree->nodes, nodes_to_reallocate * sizeof(ptree_node *));
+    if (!nodes) {
+      oom();
+    }
+    tree->nodes = nodes;
+    tree->nodes_capacity = nodes_to_reallocate;
   }
-  tree->nodes = nodes;
   for (ptree_size_int i = tree->allocated_nodes_num; i < nodes_to_reallocate;
        ++i) {
     tree->nodes[i] = malloc(sizeof(ptree_node));
@@ -206,7 +485,9 @@ static ptree_node *add_node(ptree *tree, void *ptr) {
   node->ptr = ptr;
   paint_black(node);
   paint_red(node);
+#if (PTREE_NO_PARENT_POINTERS == 0)
   node->parent = leaf;
+#endif
   node->links[0] = leaf;
   node->links[1] = leaf;
   return node;
@@ -220,12 +501,27 @@ static void release_node(ptree *tree, ptree_node *node) {
   set_node_index(node, tree->nodes_num);
   tree->nodes[node_index] = *last_ptr;
   *last_ptr = node;
+  node->ptr = NULL;
+}
+
+static void clear_cache(ptree *tree) {
+  if (tree->cache) {
+    memset(tree->cache, 0, (tree->cache_mask + 1) * sizeof(ptree_cache_entry));
+  }
 }
 
 void ptree_shrink(ptree *tree) {
+  clear_cache(tree);
   for (ptree_size_int i = tree->nodes_num; i < tree->allocated_nodes_num; ++i) {
     free(tree->nodes[i]);
   }
+  tree->allocated_nodes_num = tree->nodes_num;
+  tree->nodes_capacity = tree->nodes_num;
+  if (tree->nodes_num == 0) {
+    free(tree->nodes);
+    tree->nodes = NULL;
+    return;
+  }
   ptree_node **nodes =
       realloc(tree->nodes, tree->nodes_num * sizeof(ptree_node *));
   if (!nodes) {
@@ -234,6 +530,233 @@ void ptree_shrink(ptree *tree) {
   tree->nodes = nodes;
 }
 
+// takes an unused node out of the nodes of the tree
+static void detach_node(ptree *tree, ptree_node *node) {
+  ptree_size_int index = get_node_index(node);
+  assert(index >= tree->nodes_num && tree->nodes[index] == node);
+  --(tree->allocated_nodes_num);
+  ptree_node *last = tree->nodes[tree->allocated_nodes_num];
+  tree->nodes[index] = last;
+  set_node_index(last, index);
+}
+
+// adds a node that does not belong to any tree to the nodes of the tree, as the
+// one that add_node will use next
+static void adopt_node(ptree *tree, ptree_node *node) {
+  if (tree->allocated_nodes_num == tree->nodes_capacity) {
+    ptree_size_int capacity =
+        tree->nodes_capacity ? 2 * tree->nodes_capacity : 1;
+    if (capacity > max_nodes) {
+      oom();
+    }
+    ptree_node **nodes = realloc(tree->nodes, capacity * sizeof(ptree_node *));
+    if (!nodes) {
+      oom();
+    }
+    tree->nodes = nodes;
+    tree->nodes_capacity = capacity;
+  }
+  ptree_size_int index = tree->allocated_nodes_num++;
+  ptree_node *next = tree->nodes[tree->nodes_num];
+  if (index != tree->nodes_num) {
+    tree->nodes[index] = next;
+    set_node_index(next, index);
+  }
+  tree->nodes[tree->nodes_num] = node;
+  set_node_index(node, tree->nodes_num);
+}
+
+/******************************************************
+ * hash index
+ ******************************************************/
+
+static void index_put(ptree_hash_entry *table, size_t mask, uint64_t hash,
+                      ptree_node *node) {
+  size_t i = hash & mask;
+  while (table[i].node) {
+    i = (i + 1) & mask;
+  }
+  table[i].hash = hash;
+  table[i].node = node;
+}
+
+static void index_resize(ptree *tree, size_t size) {
+  ptree_hash_entry *table = calloc(size, sizeof(ptree_hash_entry));
+  if (!table) {
+    oom();
+  }
+  if (tree->index) {
+    for (size_t i = 0; i <= tree->index_mask; ++i) {
+      if (tree->index[i].node) {
+        index_put(table, size - 1, tree->index[i].hash, tree->index[i].node);
+      }
+    }
+    free(tree->index);
+  }
+  tree->index = table;
+  tree->index_mask = size - 1;
+}
+
+// adds a node that has just been linked to the tree
+static void index_add(ptree *tree, ptree_node *node) {
+  if (tree->nodes_num * 2 > tree->index_mask + 1) {
+    index_resize(tree, (tree->index_mask + 1) * 2);
+  }
+  index_put(tree->index, tree->index_mask, tree->hash_elem(node->ptr), node);
+}
+
+// returns the entry of the node whose element is equal to key according to
+// cmp, or NULL
+static ptree_hash_entry *index_find(const ptree *tree, ptree_cmp_fptr cmp,
+                                    uint64_t hash, const void *key) {
+  size_t i = hash & tree->index_mask;
+  while (tree->index[i].node) {
+    if (tree->index[i].hash == hash &&
+        cmp(key, tree->index[i].node->ptr) == 0) {
+      return tree->index + i;
+    }
+    i = (i + 1) & tree->index_mask;
+  }
+  return NULL;
+}
+
+static ptree_hash_entry *index_find_node(const ptree *tree,
+                                         const ptree_node *node) {
+  size_t i = tree->hash_elem(node->ptr) & tree->index_mask;
+  while (tree->index[i].node != node) {
+    assert(tree->index[i].node);
+    i = (i + 1) & tree->index_mask;
+  }
+  return tree->index + i;
+}
+
+// removes an entry, moving back the following entries of its cluster that
+// would not be reachable anymore
+static void index_erase(ptree *tree, ptree_hash_entry *entry) {
+  ptree_hash_entry *table = tree->index;
+  size_t mask = tree->index_mask;
+  size_t i = entry - table;
+  size_t j = i;
+  while (true) {
+    j = (j + 1) & mask;
+    if (!table[j].node) {
+      break;
+    }
+    size_t k = table[j].hash & mask;
+    bool reachable = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+    if (!reachable) {
+      table[i] = table[j];
+      i = j;
+    }
+  }
+  table[i].node = NULL;
+  table[i].hash = 0;
+}
+
+void ptree_set_hash_index(ptree *tree, ptree_hash_fptr hash_elem,
+                          ptree_hash_fptr hash_key) {
+  free(tree->index);
+  tree->index = NULL;
+  tree->index_mask = 0;
+  tree->hash_elem = hash_elem;
+  tree->index_hash_key = hash_key;
+  if (!hash_elem) {
+    tree->index_hash_key = NULL;
+    return;
+  }
+  size_t size = 16;
+  while (size < 2 * (size_t)tree->nodes_num) {
+    size <<= 1;
+  }
+  index_resize(tree, size);
+  for (ptree_size_int i = 0; i < tree->nodes_num; ++i) {
+    ptree_node *node = tree->nodes[i];
+    index_put(tree->index, tree->index_mask, hash_elem(node->ptr), node);
+  }
+}
+
+/******************************************************
+ * bloom filter
+ ******************************************************/
+
+#define bloom_bits_per_element 16
+#define bloom_min_capacity 256
+// the filter is rebuilt when the removed elements are more than half of the
+// elements in the tree, plus this
+#define bloom_min_removed_to_rebuild 64
+
+// the finalizer of MurmurHash3, so that each bit of the hash depends on all
+// the bits of the user provided one
+static inline uint64_t mix_hash(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// the low bits of the hash select the block, the high ones the 4 bits to set
+static inline uint64_t bloom_bits(uint64_t hash) {
+  uint64_t bits = hash >> 40;
+  return (1ULL << (bits & 63)) | (1ULL << ((bits >> 6) & 63)) |
+         (1ULL << ((bits >> 12) & 63)) | (1ULL << ((bits >> 18) & 63));
+}
+
+static void bloom_add(ptree *tree, const void *ptr) {
+  uint64_t hash = mix_hash(tree->bloom_hash_elem(ptr));
+  tree->bloom[hash & tree->bloom_mask] |= bloom_bits(hash);
+}
+
+static void bloom_rebuild(ptree *tree) {
+  size_t capacity = 2 * (size_t)tree->nodes_num;
+  if (capacity < bloom_min_capacity) {
+    capacity = bloom_min_capacity;
+  }
+  size_t size = 1;
+  while (size * 64 < capacity * bloom_bits_per_element) {
+    size <<= 1;
+  }
+  if (!tree->bloom || size != tree->bloom_mask + 1) {
+    free(tree->bloom);
+    tree->bloom = calloc(size, sizeof(uint64_t));
+    if (!tree->bloom) {
+      oom();
+    }
+    tree->bloom_mask = size - 1;
+  } else {
+    memset(tree->bloom, 0, size * sizeof(uint64_t));
+  }
+  tree->bloom_capacity = capacity;
+  tree->bloom_removed = 0;
+  for (ptree_size_int i = 0; i < tree->nodes_num; ++i) {
+    bloom_add(tree, tree->nodes[i]->ptr);
+  }
+}
+
+// returns false if there is certainly no element with the given hash
+static bool bloom_may_contain(const ptree *tree, uint64_t hash) {
+  if (tree->bloom_removed >
+      tree->nodes_num / 2 + bloom_min_removed_to_rebuild) {
+    bloom_rebuild((ptree *)tree);
+  }
+  hash = mix_hash(hash);
+  uint64_t bits = bloom_bits(hash);
+  return (tree->bloom[hash & tree->bloom_mask] & bits) == bits;
+}
+
+void ptree_set_bloom_filter(ptree *tree, ptree_hash_fptr hash_elem,
+                            ptree_hash_fptr hash_key) {
+  free(tree->bloom);
+  tree->bloom = NULL;
+  tree->bloom_mask = 0;
+  tree->bloom_hash_elem = hash_elem;
+  tree->bloom_hash_key = hash_elem ? hash_key : NULL;
+  if (hash_elem) {
+    bloom_rebuild(tree);
+  }
+}
+
 /******************************************************
  * ptree management
  ******************************************************/
@@ -247,6 +770,7 @@ ptree *ptree_new(ptree_cmp_fptr cmp_elem, ptree_cmp_fptr cmp_key,
   memset(tree, 0, sizeof *tree);
   tree->nodes = NULL;
   tree->root = leaf;
+  tree->finger = leaf;
   tree->cmp = cmp_elem;
   tree->cmp_key = cmp_key;
   ptree_allocate_nodes(tree, preallocated_nodes);
@@ -258,95 +782,558 @@ void ptree_free(ptree *tree) {
     free(tree->nodes[i]);
   }
   free(tree->nodes);
+  free(tree->cache);
+  free(tree->index);
+  free(tree->bloom);
   free(tree);
 }
 
+// returns the node of clone that is in the position of the given node of the
+// tree clone was copied from. The leaf and NULL are the same in both trees.
+static ptree_node *cloned_node(const ptree *clone, const ptree_node *node) {
+  if (!node || node == leaf) {
+    return (ptree_node *)node;
+  }
+  return clone->nodes[get_node_index(node)];
+}
+
+ptree *ptree_clone(const ptree *tree) {
+  ptree_size_int num = tree->nodes_num;
+  ptree *clone = ptree_new(tree->cmp, tree->cmp_key, 0);
+  ptree_allocate_nodes(clone, num);
+  clone->multiset = tree->multiset;
+  clone->capacity = tree->capacity;
+  clone->evict_max = tree->evict_max;
+  clone->use_finger = tree->use_finger;
+  // node i of the clone is the copy of node i of the tree
+  for (ptree_size_int i = 0; i < num; ++i) {
+    const ptree_node *src = tree->nodes[i];
+    ptree_node *dst = clone->nodes[i];
+    dst->ptr = src->ptr;
+    dst->links[0] = cloned_node(clone, src->links[0]);
+    dst->links[1] = cloned_node(clone, src->links[1]);
+#if (PTREE_NO_PARENT_POINTERS == 0)
+    dst->parent = cloned_node(clone, src->parent);
+#endif
+#if (PTREE_THREADED == 1)
+    dst->threads[0] = cloned_node(clone, src->threads[0]);
+    dst->threads[1] = cloned_node(clone, src->threads[1]);
+#endif
+    copy_color(dst, src);
+  }
+  clone->nodes_num = num;
+  clone->root = cloned_node(clone, tree->root);
+  clone->min = cloned_node(clone, tree->min);
+  clone->max = cloned_node(clone, tree->max);
+  if (tree->cache) {
+    ptree_set_lookup_cache(clone, tree->cache_hash_key, tree->cache_mask + 1);
+  }
+  if (tree->index) {
+    clone->hash_elem = tree->hash_elem;
+    clone->index_hash_key = tree->index_hash_key;
+    clone->index_mask = tree->index_mask;
+    clone->index = malloc((tree->index_mask + 1) * sizeof(ptree_hash_entry));
+    if (!clone->index) {
+      oom();
+    }
+    for (size_t i = 0; i <= tree->index_mask; ++i) {
+      clone->index[i].hash = tree->index[i].hash;
+      clone->index[i].node = cloned_node(clone, tree->index[i].node);
+    }
+  }
+  if (tree->bloom) {
+    clone->bloom_hash_elem = tree->bloom_hash_elem;
+    clone->bloom_hash_key = tree->bloom_hash_key;
+    clone->bloom_mask = tree->bloom_mask;
+    clone->bloom_capacity = tree->bloom_capacity;
+    clone->bloom_removed = tree->bloom_removed;
+    clone->bloom = malloc((tree->bloom_mask + 1) * sizeof(uint64_t));
+    if (!clone->bloom) {
+      oom();
+    }
+    memcpy(clone->bloom, tree->bloom,
+           (tree->bloom_mask + 1) * sizeof(uint64_t));
+  }
+  return clone;
+}
+
+// how many nodes ahead of the current one ptree_clear_with prefetches
+#define clear_prefetch_distance 8
+
+// calls fn on the elements in the order of the nodes array, prefetching the
+// nodes that come next, as they are allocated separately
+static void destroy_elements(ptree *tree, ptree_destroy_fptr fn, void *ctx) {
+  ptree_size_int num = tree->nodes_num;
+  for (ptree_size_int i = 0; i < num; ++i) {
+    if (i + clear_prefetch_distance < num) {
+      prefetch(tree->nodes[i + clear_prefetch_distance]);
+    }
+    fn(tree->nodes[i]->ptr, ctx);
+  }
+}
+
+void ptree_clear_with(ptree *tree, ptree_destroy_fptr fn, void *ctx) {
+  destroy_elements(tree, fn, ctx);
+  ptree_empty(tree);
+}
+
+void ptree_free_with(ptree *tree, ptree_destroy_fptr fn, void *ctx) {
+  destroy_elements(tree, fn, ctx);
+  ptree_free(tree);
+}
+
 void ptree_empty(ptree *tree) {
   tree->root = leaf;
+  tree->min = NULL;
+  tree->max = NULL;
+  tree->finger = leaf;
   tree->nodes_num = 0;
+  clear_cache(tree);
+  if (tree->index) {
+    memset(tree->index, 0, (tree->index_mask + 1) * sizeof(ptree_hash_entry));
+  }
+  if (tree->bloom) {
+    memset(tree->bloom, 0, (tree->bloom_mask + 1) * sizeof(uint64_t));
+    tree->bloom_removed = 0;
+  }
+}
+
+void ptree_set_finger_search(ptree *tree, int enabled) {
+#if (PTREE_NO_PARENT_POINTERS == 1)
+  // searches cannot climb from the finger, so it is never stored, and lookups
+  // on a const tree stay read-only
+  (void)enabled;
+  tree->use_finger = false;
+#else
+  tree->use_finger = enabled != 0;
+#endif
+  tree->finger = leaf;
+}
+
+int ptree_get_finger_search(const ptree *tree) { return tree->use_finger; }
+
+#if (PTREE_NO_PARENT_POINTERS == 0)
+
+void ptree_set_multiset(ptree *tree, int enabled) {
+  assert(tree->nodes_num == 0);
+  tree->multiset = enabled != 0;
+}
+
+#endif
+
+int ptree_get_multiset(const ptree *tree) { return tree->multiset; }
+
+void ptree_set_capacity(ptree *tree, size_t capacity, int evict_max) {
+  assert(capacity == 0 || tree->nodes_num <= capacity);
+  tree->capacity = capacity;
+  tree->evict_max = evict_max != 0;
+}
+
+size_t ptree_get_capacity(const ptree *tree) { return tree->capacity; }
+
+void ptree_set_lookup_cache(ptree *tree, ptree_hash_fptr hash_key,
+                            size_t num_entries) {
+  free(tree->cache);
+  tree->cache = NULL;
+  tree->cache_mask = 0;
+  tree->cache_hash_key = NULL;
+  if (!hash_key || num_entries == 0) {
+    return;
+  }
+  size_t size = 1;
+  while (size < num_entries) {
+    size <<= 1;
+  }
+  tree->cache = calloc(size, sizeof(ptree_cache_entry));
+  if (!tree->cache) {
+    oom();
+  }
+  tree->cache_mask = size - 1;
+  tree->cache_hash_key = hash_key;
 }
 
 /******************************************************
  * getters
  ******************************************************/
 
-ptree_it *ptree_get_it(const ptree *tree, const void *key) {
-  ptree_node *it = tree->root;
-  while (it != leaf) {
-    int diff = tree->cmp_key(key, it->ptr);
-    if (diff == 0) {
-      return (ptree_it *)it;
-    }
-    int dir = diff > 0;
-    if (has_child(it, dir)) {
-      it = it->links[dir];
-    } else {
-      return NULL;
-    }
+// returns the node from which to search for key: the root, or, if the tree uses
+// a finger, the lowest ancestor of the finger whose subtree can contain key
+static ptree_node *search_start(const ptree *tree, ptree_cmp_fptr cmp,
+                                const void *key) {
+#if (PTREE_NO_PARENT_POINTERS == 1)
+  // climbing from the finger needs parent pointers
+  (void)cmp;
+  (void)key;
+  return tree->root;
+#else
+  ptree_node *x = tree->finger;
+  if (!tree->use_finger || x == leaf) {
+    return tree->root;
   }
-  return NULL;
-}
-
-void *ptree_get(const ptree *tree, const void *key) {
-  ptree_it *it = ptree_get_it(tree, key);
-  if (it) {
-    return it->ptr;
+  int diff = cmp(key, x->ptr);
+  if (diff == 0) {
+    return x;
   }
-  return NULL;
+  int dir = diff > 0;
+  // the subtree of x contains the finger, so it can contain key if key is on
+  // the other side of the nearest ancestor of x on the side of key
+  while (x != tree->root) {
+    ptree_node *parent = x->parent;
+    if (x == parent->links[!dir]) {
+      diff = cmp(key, parent->ptr);
+      if (diff == 0) {
+        return parent;
+      }
+      if ((diff > 0) != dir) {
+        break;
+      }
+    }
+    x = parent;
+  }
+  return x;
+#endif
 }
 
-static ptree_node *ptree_search(const ptree *tree, const void *ptr) {
-  if (tree->root == leaf) {
-    return NULL;
-  }
-  ptree_node *z = tree->root;
-  while (z != leaf) {
-    int diff = tree->cmp(ptr, z->ptr);
+// searches the tree for key using cmp, returns the node equal to key if there
+// is one, else NULL. In both cases, stores in parent and dir where a node equal
+// to key would be linked to the tree
+static ptree_node *locate(const ptree *tree, ptree_cmp_fptr cmp,
+                          const void *key, ptree_node **parent, int *dir) {
+  ptree_node *x = search_start(tree, cmp, key);
+  *parent = leaf;
+  *dir = 0;
+  while (x != leaf) {
+    int diff = cmp(key, x->ptr);
     if (diff == 0) {
       break;
     }
-    int dir = diff > 0;
-    if (has_child(z, dir)) {
-      z = z->links[dir];
+    *parent = x;
+    *dir = diff > 0;
+    x = x->links[*dir];
+  }
+  if (tree->use_finger) {
+    ((ptree *)tree)->finger = x != leaf ? x : *parent;
+  }
+  return x != leaf ? x : NULL;
+}
+
+// returns the first node whose element is greater than key according to cmp,
+// or not less than key if lower is set, or NULL if there is none
+static ptree_node *bound(const ptree *tree, ptree_cmp_fptr cmp,
+                         const void *key, bool lower) {
+  ptree_node *x = tree->root;
+  ptree_node *found = NULL;
+  while (x != leaf) {
+    int diff = cmp(key, x->ptr);
+    if (diff < 0 || (lower && diff == 0)) {
+      found = x;
+      x = x->links[0];
     } else {
-      return NULL;
+      x = x->links[1];
     }
   }
-  return z;
+  return found;
 }
 
-ptree_it *ptree_has(const ptree *tree, const void *ptr) {
-  ptree_node *node = ptree_search(tree, ptr);
-  if (!node) {
+ptree_it *ptree_get_it(const ptree *tree, const void *key) {
+  ptree_node *parent;
+  int dir;
+  if (tree->bloom_hash_key &&
+      !bloom_may_contain(tree, tree->bloom_hash_key(key))) {
     return NULL;
   }
+  if (tree->index_hash_key) {
+    ptree_hash_entry *entry = index_find(tree, tree->cmp_key,
+                                         tree->index_hash_key(key), key);
+    return entry ? (ptree_it *)entry->node : NULL;
+  }
+  if (!tree->cache) {
+    return (ptree_it *)locate(tree, tree->cmp_key, key, &parent, &dir);
+  }
+  uint64_t hash = tree->cache_hash_key(key);
+  ptree_cache_entry *entry = tree->cache + (hash & tree->cache_mask);
+  ptree_node *node = entry->node;
+  if (node && entry->hash == hash && entry->index < tree->nodes_num &&
+      tree->nodes[entry->index] == node &&
+      tree->cmp_key(key, node->ptr) == 0) {
+    if (tree->use_finger) {
+      ((ptree *)tree)->finger = node;
+    }
+    return (ptree_it *)node;
+  }
+  node = locate(tree, tree->cmp_key, key, &parent, &dir);
+  if (node) {
+    entry->hash = hash;
+    entry->node = node;
+    entry->index = get_node_index(node);
+  }
   return (ptree_it *)node;
 }
 
-ptree_it *ptree_min(ptree *tree) {
-  if (tree->root == leaf) {
+void *ptree_get(const ptree *tree, const void *key) {
+  ptree_it *it = ptree_get_it(tree, key);
+  if (it) {
+    return it->ptr;
+  }
+  return NULL;
+}
+
+void ptree_equal_range(const ptree *tree, const void *key, ptree_it **begin,
+                       ptree_it **end) {
+  ptree_node *first = bound(tree, tree->cmp_key, key, true);
+  *begin = (ptree_it *)first;
+  if (!first || tree->cmp_key(key, first->ptr) != 0) {
+    *end = (ptree_it *)first;
+    return;
+  }
+  *end = (ptree_it *)bound(tree, tree->cmp_key, key, false);
+}
+
+static int count_visit(void *ptr, void *ctx) {
+  (void)ptr;
+  ++*(size_t *)ctx;
+  return 0;
+}
+
+size_t ptree_count(const ptree *tree, const void *key) {
+  size_t count = 0;
+  ptree_foreach_range(tree, key, key, count_visit, &count);
+  return count;
+}
+
+// number of lookups that ptree_get_many runs in lock-step
+#define get_many_group_size 16
+
+void ptree_get_many(const ptree *tree, const void **keys, size_t n,
+                    void **out) {
+  ptree_node *group[get_many_group_size];
+  for (size_t begin = 0; begin < n; begin += get_many_group_size) {
+    size_t count = n - begin;
+    if (count > get_many_group_size) {
+      count = get_many_group_size;
+    }
+    size_t active = 0;
+    for (size_t i = 0; i < count; ++i) {
+      out[begin + i] = NULL;
+      group[i] = tree->root;
+      if (group[i] != leaf) {
+        ++active;
+      }
+    }
+    // each round moves every pending lookup one level down, prefetching the
+    // nodes and elements that the next round will touch, so that the cache
+    // misses of different lookups overlap
+    while (active) {
+      for (size_t i = 0; i < count; ++i) {
+        if (group[i] != leaf) {
+          prefetch(group[i]->ptr);
+        }
+      }
+      for (size_t i = 0; i < count; ++i) {
+        ptree_node *it = group[i];
+        if (it == leaf) {
+          continue;
+        }
+        int diff = tree->cmp_key(keys[begin + i], it->ptr);
+        if (diff == 0) {
+          out[begin + i] = it->ptr;
+          it = leaf;
+        } else {
+          it = it->links[diff > 0];
+        }
+        if (it == leaf) {
+          --active;
+        } else {
+          prefetch(it);
+        }
+        group[i] = it;
+      }
+    }
+  }
+}
+
+void ptree_get_many_sorted(const ptree *tree, const void **keys, size_t n,
+                           void **out) {
+  // the path from the root to the node where the previous lookup ended. The
+  // subtree rooted in a node of the path contains the previous key, so it
+  // contains the current key if the current key is less than the element of
+  // the nearest ancestor of which the node is in the left subtree
+  ptree_node *path[PTREE_MAX_HEIGHT];
+  size_t depth = 0;
+  for (size_t i = 0; i < n; ++i) {
+    out[i] = NULL;
+    while (depth > 1) {
+      ptree_node *parent = path[depth - 2];
+      if (path[depth - 1] == parent->links[0]) {
+        int diff = tree->cmp_key(keys[i], parent->ptr);
+        if (diff < 0) {
+          break;
+        }
+        if (diff == 0) {
+          out[i] = parent->ptr;
+          break;
+        }
+      }
+      --depth;
+    }
+    if (out[i]) {
+      --depth;
+      continue;
+    }
+    ptree_node *it = depth ? path[--depth] : tree->root;
+    while (it != leaf) {
+      path[depth++] = it;
+      int diff = tree->cmp_key(keys[i], it->ptr);
+      if (diff == 0) {
+        out[i] = it->ptr;
+        break;
+      }
+      it = it->links[diff > 0];
+    }
+  }
+}
+
+#if (PTREE_NO_PARENT_POINTERS == 0)
+
+// returns the node of ptr itself, among the elements equal to it in a multiset
+static ptree_node *search_identical(const ptree *tree, const void *ptr) {
+  if (tree->index) {
+    uint64_t hash = tree->hash_elem(ptr);
+    size_t i = hash & tree->index_mask;
+    while (tree->index[i].node) {
+      if (tree->index[i].node->ptr == ptr) {
+        return tree->index[i].node;
+      }
+      i = (i + 1) & tree->index_mask;
+    }
     return NULL;
   }
-  ptree_node *it = tree->root;
-  while (has_child(it, 0)) {
-    it = it->links[0];
+  ptree_node *node = bound(tree, tree->cmp, ptr, true);
+  while (node && tree->cmp(ptr, node->ptr) == 0) {
+    if (node->ptr == ptr) {
+      return node;
+    }
+    node = get_next_node(node);
   }
-  return (ptree_it *)it;
+  return NULL;
 }
 
-ptree_it *ptree_max(ptree *tree) {
-  if (tree->root == leaf) {
+#endif
+
+static ptree_node *ptree_search(const ptree *tree, const void *ptr) {
+  ptree_node *parent;
+  int dir;
+  if (tree->bloom && !bloom_may_contain(tree, tree->bloom_hash_elem(ptr))) {
     return NULL;
   }
-  ptree_node *it = tree->root;
-  while (has_child(it, 1)) {
-    it = it->links[1];
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  if (tree->multiset) {
+    return search_identical(tree, ptr);
+  }
+#endif
+  if (tree->index) {
+    ptree_hash_entry *entry =
+        index_find(tree, tree->cmp, tree->hash_elem(ptr), ptr);
+    return entry ? entry->node : NULL;
+  }
+  return locate(tree, tree->cmp, ptr, &parent, &dir);
+}
+
+ptree_it *ptree_has(const ptree *tree, const void *ptr) {
+  ptree_node *node = ptree_search(tree, ptr);
+  if (!node) {
+    return NULL;
   }
-  return (ptree_it *)it;
+  return (ptree_it *)node;
 }
 
+ptree_it *ptree_min(ptree *tree) { return (ptree_it *)tree->min; }
+
+ptree_it *ptree_max(ptree *tree) { return (ptree_it *)tree->max; }
+
 int32_t ptree_size(const ptree *tree) { return tree->nodes_num; }
 
+// updates the optional structures after x has been linked to the tree as the
+// dir child of parent
+static void on_node_linked(ptree *tree, ptree_node *x, ptree_node *parent,
+                           int dir) {
+  // x is the inorder neighbour of parent on the side of dir
+  if (parent == leaf) {
+    tree->min = x;
+    tree->max = x;
+  } else if (dir == 0 && parent == tree->min) {
+    tree->min = x;
+  } else if (dir == 1 && parent == tree->max) {
+    tree->max = x;
+  }
+#if (PTREE_THREADED == 1)
+  if (parent == leaf) {
+    x->threads[0] = NULL;
+    x->threads[1] = NULL;
+  } else {
+    // x goes between parent and its neighbour on the side of dir
+    ptree_node *neighbour = parent->threads[dir];
+    x->threads[!dir] = parent;
+    x->threads[dir] = neighbour;
+    parent->threads[dir] = x;
+    if (neighbour) {
+      neighbour->threads[!dir] = x;
+    }
+  }
+#else
+  (void)parent;
+  (void)dir;
+#endif
+  if (tree->index) {
+    index_add(tree, x);
+  }
+  if (tree->bloom) {
+    if (tree->nodes_num > tree->bloom_capacity) {
+      bloom_rebuild(tree);
+    } else {
+      bloom_add(tree, x->ptr);
+    }
+  }
+}
+
+// updates the optional structures before z is removed from the tree
+static void on_node_unlinked(ptree *tree, ptree_node *z) {
+#if (PTREE_NO_PARENT_POINTERS == 0 || PTREE_THREADED == 1)
+  if (z == tree->min) {
+    tree->min = get_next_node(z);
+  }
+  if (z == tree->max) {
+    tree->max = get_prev_node(z);
+  }
+#endif
+  if (tree->bloom) {
+    ++(tree->bloom_removed);
+  }
+  if (tree->index) {
+    index_erase(tree, index_find_node(tree, z));
+  }
+#if (PTREE_THREADED == 1)
+  if (z->threads[0]) {
+    z->threads[0]->threads[1] = z->threads[1];
+  }
+  if (z->threads[1]) {
+    z->threads[1]->threads[0] = z->threads[0];
+  }
+#endif
+}
+
+#if (PTREE_NO_PARENT_POINTERS == 0)
+
+// replaces the subtree rooted in u with the one rooted in v
+static void transplant(ptree *tree, ptree_node *u, ptree_node *v) {
+  if (u->parent == leaf) {
+    tree->root = v;
+  } else {
+    u->parent->links[is_child(u, 1)] = v;
+  }
+  v->parent = u->parent;
+}
+
 static void rotate(ptree *tree, ptree_node *x, int dir) {
   assert(has_child(x, !dir));
   ptree_node *y = x->links[!dir];
@@ -368,31 +1355,7 @@ static void rotate(ptree *tree, ptree_node *x, int dir) {
   x->parent = y;
 }
 
-bool ptree_insert(ptree *tree, void *ptr) {
-  if (tree->root == leaf) {
-    tree->root = add_node(tree, ptr);
-    paint_black(tree->root);
-    return true;
-  }
-  // insertion
-  ptree_node *x = tree->root;
-  while (true) {
-    int cmp = tree->cmp(ptr, x->ptr);
-    if (cmp == 0) {
-      return false;
-    } else {
-      int dir = cmp > 0;
-      if (has_child(x, dir)) {
-        x = x->links[dir];
-      } else {
-        x->links[dir] = add_node(tree, ptr);
-        x->links[dir]->parent = x;
-        x = x->links[dir];
-        break;
-      }
-    }
-  }
-  // keep tree balanced
+static void insert_fixup(ptree *tree, ptree_node *x) {
   while (x != tree->root && is_red(x->parent)) {
     bool lefty = is_child(x->parent, 0);
     ptree_node *y = x->parent->parent->links[lefty];
@@ -412,28 +1375,420 @@ bool ptree_insert(ptree *tree, void *ptr) {
     }
   }
   paint_black(tree->root);
-  return true;
 }
 
-static bool ptree_remove_node(ptree *tree, ptree_node *z) {
-  ptree_node *y;
-  if (!has_child(z, 0) || !has_child(z, 1)) {
-    y = z;
+// links x, which is not in the tree and has no children, as the dir child of
+// parent, which must not have such a child, and keeps the tree balanced
+static void link_existing(ptree *tree, ptree_node *parent, int dir,
+                          ptree_node *x) {
+  if (parent == leaf) {
+    tree->root = x;
   } else {
-    y = get_next_node(z);
+    assert(!has_child(parent, dir));
+    parent->links[dir] = x;
   }
-  ptree_node *x = y->links[!has_child(y, 0)];
-  x->parent = y->parent;
-  if (y->parent == leaf) {
-    tree->root = x;
+  x->parent = parent;
+  insert_fixup(tree, x);
+  on_node_linked(tree, x, parent, dir);
+}
+
+// creates a node for ptr as the dir child of parent, which must not have
+// such a child, and keeps the tree balanced
+static ptree_node *link_node(ptree *tree, ptree_node *parent, int dir,
+                             void *ptr) {
+  ptree_node *x = add_node(tree, ptr);
+  link_existing(tree, parent, dir, x);
+  return x;
+}
+
+// inserts an element and returns its node, or, if unique is set, returns the
+// node of the element that is equal to it if there is one. If make is NULL, the
+// element is key, else key is compared with cmp_key and the element is made by
+// make only if it is inserted.
+static ptree_node *insert_with(ptree *tree, const void *key,
+                               ptree_make_fptr make, void *ctx, bool unique,
+                               bool *inserted) {
+  ptree_cmp_fptr cmp = make ? tree->cmp_key : tree->cmp;
+  ptree_hash_fptr hash = make ? tree->index_hash_key : tree->hash_elem;
+  ptree_node *parent;
+  int dir;
+  if (tree->index && hash && unique) {
+    ptree_hash_entry *entry = index_find(tree, cmp, hash(key), key);
+    if (entry) {
+      *inserted = false;
+      return entry->node;
+    }
+  }
+  ptree_node *x;
+  if (unique) {
+    x = locate(tree, cmp, key, &parent, &dir);
+    if (x) {
+      *inserted = false;
+      return x;
+    }
+  } else {
+    // the element goes after the ones equal to it
+    parent = leaf;
+    dir = 0;
+    for (x = tree->root; x != leaf; x = x->links[dir]) {
+      parent = x;
+      dir = cmp(key, x->ptr) >= 0;
+    }
+  }
+  *inserted = true;
+  void *ptr = make ? make(key, ctx) : (void *)key;
+  x = link_node(tree, parent, dir, ptr);
+  if (tree->use_finger) {
+    tree->finger = x;
+  }
+  return x;
+}
+
+#else
+
+/* top-down insertion and removal, after Julienne Walker's tutorial on red
+ * black trees, which only need the links from the nodes to their children */
+
+static ptree_node *single_rotation(ptree_node *root, int dir) {
+  ptree_node *save = root->links[!dir];
+  root->links[!dir] = save->links[dir];
+  save->links[dir] = root;
+  paint_red(root);
+  paint_black(save);
+  return save;
+}
+
+static ptree_node *double_rotation(ptree_node *root, int dir) {
+  root->links[!dir] = single_rotation(root->links[!dir], !dir);
+  return single_rotation(root, dir);
+}
+
+// inserts an element and returns its node, or, if unique is set, returns the
+// node of the element that is equal to it if there is one. If make is NULL, the
+// element is key, else key is compared with cmp_key and the element is made by
+// make only if it is inserted. On the way down, splits the nodes with two red
+// children and fixes red violations, so no way back up is needed.
+static ptree_node *insert_with(ptree *tree, const void *key,
+                               ptree_make_fptr make, void *ctx, bool unique,
+                               bool *inserted) {
+  ptree_cmp_fptr cmp = make ? tree->cmp_key : tree->cmp;
+  ptree_hash_fptr hash = make ? tree->index_hash_key : tree->hash_elem;
+  *inserted = false;
+  if (tree->index && hash && unique) {
+    ptree_hash_entry *entry = index_find(tree, cmp, hash(key), key);
+    if (entry) {
+      return entry->node;
+    }
+  }
+  if (tree->root == leaf) {
+    tree->root = add_node(tree, make ? make(key, ctx) : (void *)key);
+    paint_black(tree->root);
+    *inserted = true;
+    on_node_linked(tree, tree->root, leaf, 0);
+    return tree->root;
+  }
+  // a fake parent of the root
+  ptree_node head;
+  memset(&head, 0, sizeof head);
+  head.links[0] = leaf;
+  head.links[1] = tree->root;
+  // great-grandparent, grandparent, parent and current node
+  ptree_node *t = &head;
+  ptree_node *g = leaf;
+  ptree_node *p = leaf;
+  ptree_node *q = tree->root;
+  ptree_node *x = NULL;
+  int dir = 0;
+  int last = 0;
+  while (true) {
+    if (q == leaf) {
+      q = add_node(tree, make ? make(key, ctx) : (void *)key);
+      p->links[dir] = q;
+      x = q;
+    } else if (is_red(q->links[0]) && is_red(q->links[1])) {
+      paint_red(q);
+      paint_black(q->links[0]);
+      paint_black(q->links[1]);
+    }
+    if (is_red(q) && is_red(p)) {
+      int dir2 = t->links[1] == g;
+      if (q == p->links[last]) {
+        t->links[dir2] = single_rotation(g, !last);
+      } else {
+        t->links[dir2] = double_rotation(g, !last);
+      }
+    }
+    if (x) {
+      *inserted = true;
+      break;
+    }
+    int diff = cmp(key, q->ptr);
+    if (diff == 0 && unique) {
+      x = q;
+      break;
+    }
+    last = dir;
+    dir = unique ? diff > 0 : diff >= 0;
+    if (g != leaf) {
+      t = g;
+    }
+    g = p;
+    p = q;
+    q = q->links[dir];
+  }
+  tree->root = head.links[1];
+  paint_black(tree->root);
+  if (*inserted) {
+    on_node_linked(tree, x, p, dir);
+  }
+  return x;
+}
+
+#if (PTREE_THREADED == 0)
+
+// returns the last node in direction dir, or NULL if the tree is empty
+static ptree_node *extreme_node(const ptree *tree, int dir) {
+  if (tree->root == leaf) {
+    return NULL;
+  }
+  ptree_node *it = tree->root;
+  while (has_child(it, dir)) {
+    it = it->links[dir];
+  }
+  return it;
+}
+
+#endif
+
+// removes the element equal to key according to cmp, if there is one. On the
+// way down, pushes a red node along the path, so that the node that is unlinked
+// is red and no way back up is needed. The node that is unlinked is the
+// in-order predecessor of the removed one, which then takes its place.
+static bool remove_top_down(ptree *tree, ptree_cmp_fptr cmp, const void *key) {
+  if (tree->root == leaf) {
+    return false;
+  }
+  ptree_node head;
+  memset(&head, 0, sizeof head);
+  head.links[0] = leaf;
+  head.links[1] = tree->root;
+  // grandparent, parent, current node, found node and its parent
+  ptree_node *g = leaf;
+  ptree_node *p = leaf;
+  ptree_node *q = &head;
+  ptree_node *f = NULL;
+  ptree_node *fp = NULL;
+  int dir = 1;
+  while (q->links[dir] != leaf) {
+    int last = dir;
+    g = p;
+    p = q;
+    q = q->links[dir];
+    int diff = cmp(key, q->ptr);
+    if (diff == 0) {
+      f = q;
+      fp = p;
+    }
+    dir = diff > 0;
+    if (is_red(q) || is_red(q->links[dir])) {
+      continue;
+    }
+    if (is_red(q->links[!dir])) {
+      p = p->links[last] = single_rotation(q, dir);
+      if (q == f) {
+        fp = p;
+      }
+      continue;
+    }
+    ptree_node *s = p->links[!last];
+    if (s == leaf) {
+      continue;
+    }
+    if (is_black(s->links[0]) && is_black(s->links[1])) {
+      paint_black(p);
+      paint_red(s);
+      paint_red(q);
+    } else {
+      int dir2 = g->links[1] == p;
+      if (is_red(s->links[last])) {
+        g->links[dir2] = double_rotation(p, last);
+      } else {
+        g->links[dir2] = single_rotation(p, last);
+      }
+      // the rotation moves p, which can be f, under the new root of the subtree
+      if (p == f) {
+        fp = g->links[dir2];
+      }
+      paint_red(q);
+      paint_red(g->links[dir2]);
+      paint_black(g->links[dir2]->links[0]);
+      paint_black(g->links[dir2]->links[1]);
+    }
+  }
+  if (f) {
+    on_node_unlinked(tree, f);
+    p->links[p->links[1] == q] = q->links[q->links[0] == leaf];
+    if (q != f) {
+      q->links[0] = f->links[0];
+      q->links[1] = f->links[1];
+      copy_color(q, f);
+      fp->links[fp->links[1] == f] = q;
+    }
+    release_node(tree, f);
+  }
+  tree->root = head.links[1];
+  paint_black(tree->root);
+#if (PTREE_THREADED == 0)
+  // without the way back up, the new extremes are searched from the root
+  if (f && f == tree->min) {
+    tree->min = extreme_node(tree, 0);
+  }
+  if (f && f == tree->max) {
+    tree->max = extreme_node(tree, 1);
+  }
+#endif
+  return f != NULL;
+}
+
+#endif
+
+static ptree_node *insert_node(ptree *tree, void *ptr, bool *inserted) {
+  return insert_with(tree, ptr, NULL, NULL, !tree->multiset, inserted);
+}
+
+bool ptree_insert(ptree *tree, void *ptr) {
+  if (tree->capacity) {
+    return ptree_insert_evict(tree, ptr) != ptr;
+  }
+  bool inserted;
+  insert_node(tree, ptr, &inserted);
+  return inserted;
+}
+
+void *ptree_insert_evict(ptree *tree, void *ptr) {
+  bool full = tree->capacity && tree->nodes_num >= tree->capacity;
+  if (full) {
+    // reject ptr with a single comparison if it would be evicted right away,
+    // or if it is equal to the element that would be evicted in a set
+    ptree_node *victim = tree->evict_max ? tree->max : tree->min;
+    int diff = tree->cmp(ptr, victim->ptr);
+    if (tree->evict_max ? diff >= 0
+                        : diff < 0 || (diff == 0 && !tree->multiset)) {
+      return ptr;
+    }
+  }
+  bool inserted;
+  insert_node(tree, ptr, &inserted);
+  if (!inserted) {
+    return ptr;
+  }
+  if (full) {
+    return tree->evict_max ? ptree_pop_max(tree) : ptree_pop_min(tree);
+  }
+  return NULL;
+}
+
+bool ptree_insert_or_get(ptree *tree, void *ptr, ptree_it **out) {
+  bool inserted;
+  ptree_node *node = insert_with(tree, ptr, NULL, NULL, true, &inserted);
+  if (out) {
+    *out = (ptree_it *)node;
+  }
+  return inserted;
+}
+
+bool ptree_insert_or_get_by_key(ptree *tree, const void *key,
+                                ptree_make_fptr make, void *ctx,
+                                ptree_it **out) {
+  bool inserted;
+  ptree_node *node = insert_with(tree, key, make, ctx, true, &inserted);
+  if (out) {
+    *out = (ptree_it *)node;
+  }
+  return inserted;
+}
+
+ptree_it *ptree_insert_hint(ptree *tree, ptree_it *hint, void *ptr) {
+  bool inserted;
+#if (PTREE_NO_PARENT_POINTERS == 1)
+  // without the way back up, the tree can only be rebalanced top-down
+  (void)hint;
+  return (ptree_it *)insert_node(tree, ptr, &inserted);
+#else
+  ptree_node *h = hint ? (ptree_node *)hint : (ptree_node *)ptree_max(tree);
+  if (!h) {
+    return (ptree_it *)insert_node(tree, ptr, &inserted);
+  }
+  // in a multiset, ptr goes after the elements equal to it
+  int cmp = tree->cmp(ptr, h->ptr);
+  if (cmp == 0 && !tree->multiset) {
+    return (ptree_it *)h;
+  }
+  int dir = cmp >= 0;
+  // the in-order neighbour of h on the side of ptr. The extremes are cached, so
+  // appending at either end does not climb the tree to find out there is none
+  ptree_node *neighbour = NULL;
+  if (h != (dir ? tree->max : tree->min)) {
+    neighbour = dir ? get_next_node(h) : get_prev_node(h);
+  }
+  if (neighbour) {
+    int neighbour_cmp = tree->cmp(ptr, neighbour->ptr);
+    if (neighbour_cmp == 0 && !tree->multiset) {
+      return (ptree_it *)neighbour;
+    }
+    if ((neighbour_cmp >= 0) == dir) {
+      // ptr is not adjacent to the hint
+      return (ptree_it *)insert_node(tree, ptr, &inserted);
+    }
+  }
+  // ptr goes between h and its neighbour: either h has no child on that side,
+  // or the neighbour is in the subtree of that child and has no child on the
+  // opposite side
+  if (!has_child(h, dir)) {
+    return (ptree_it *)link_node(tree, h, dir, ptr);
+  }
+  return (ptree_it *)link_node(tree, neighbour, !dir, ptr);
+#endif
+}
+
+#if (PTREE_NO_PARENT_POINTERS == 0)
+
+// unlinks z from the tree and keeps the tree balanced, without releasing z
+static void unlink_node(ptree *tree, ptree_node *z) {
+  on_node_unlinked(tree, z);
+  // x takes the place of the node that leaves its position in the tree, which
+  // is z if it has at most one child, else the next node, that then takes the
+  // place of z, so that no element changes node
+  ptree_node *x;
+  bool removed_black;
+  if (!has_child(z, 0) || !has_child(z, 1)) {
+    x = z->links[!has_child(z, 0)];
+    removed_black = is_black(z);
+    transplant(tree, z, x);
   } else {
-    y->parent->links[is_child(y, 1)] = x;
+    ptree_node *y = z->links[1];
+    while (has_child(y, 0)) {
+      y = y->links[0];
+    }
+    x = y->links[1];
+    removed_black = is_black(y);
+    if (y->parent == z) {
+      x->parent = y;
+    } else {
+      transplant(tree, y, x);
+      y->links[1] = z->links[1];
+      y->links[1]->parent = y;
+    }
+    transplant(tree, z, y);
+    y->links[0] = z->links[0];
+    y->links[0]->parent = y;
+    copy_color(y, z);
   }
-  if (y != z) {
-    z->ptr = y->ptr;
+  if (tree->use_finger) {
+    tree->finger = x->parent != leaf ? x->parent : tree->root;
   }
   // keep tree balanced
-  if (is_black(y)) {
+  if (removed_black) {
     while (x != tree->root && is_black(x)) {
       bool XL = is_child(x, 0);
       ptree_node *w = x->parent->links[XL];
@@ -465,30 +1820,960 @@ static bool ptree_remove_node(ptree *tree, ptree_node *z) {
     }
   }
   paint_black(x);
-  release_node(tree, y);
+}
+
+#endif
+
+static bool ptree_remove_node(ptree *tree, ptree_node *z) {
+#if (PTREE_NO_PARENT_POINTERS == 1)
+  // without parent pointers, the path to z is found again from the root
+  return remove_top_down(tree, tree->cmp, z->ptr);
+#else
+  unlink_node(tree, z);
+  release_node(tree, z);
   return true;
+#endif
+}
+
+// returns the next node of a node of the tree, or NULL
+static ptree_node *successor(const ptree *tree, ptree_node *node) {
+#if (PTREE_NO_PARENT_POINTERS == 0 || PTREE_THREADED == 1)
+  (void)tree;
+  return get_next_node(node);
+#else
+  // the last node from which the search for node went left
+  ptree_node *next = NULL;
+  ptree_node *x = tree->root;
+  while (x != node) {
+    int dir = tree->cmp(node->ptr, x->ptr) > 0;
+    if (!dir) {
+      next = x;
+    }
+    x = x->links[dir];
+  }
+  if (has_child(node, 1)) {
+    next = node->links[1];
+    while (has_child(next, 0)) {
+      next = next->links[0];
+    }
+  }
+  return next;
+#endif
 }
 
 bool ptree_remove(ptree *tree, const void *ptr) {
   if (tree->root == leaf) {
     return false;
   }
+#if (PTREE_NO_PARENT_POINTERS == 1)
+  if (tree->bloom && !bloom_may_contain(tree, tree->bloom_hash_elem(ptr))) {
+    return false;
+  }
+  return remove_top_down(tree, tree->cmp, ptr);
+#else
   ptree_node *z = ptree_search(tree, ptr);
   if (!z) {
     return false;
   }
   return ptree_remove_node(tree, z);
+#endif
 }
 
-void ptree_remove_by_it(ptree *tree, ptree_it *it) {
+ptree_it *ptree_remove_by_it(ptree *tree, ptree_it *it) {
+  ptree_node *next = successor(tree, (ptree_node *)it);
   ptree_remove_node(tree, (ptree_node *)it);
+  return (ptree_it *)next;
 }
 
 bool ptree_remove_by_key(ptree *tree, void *key) {
-  ptree_it *it = ptree_get_it(tree, key);
+#if (PTREE_NO_PARENT_POINTERS == 1)
+  if (tree->bloom_hash_key &&
+      !bloom_may_contain(tree, tree->bloom_hash_key(key))) {
+    return false;
+  }
+  return remove_top_down(tree, tree->cmp_key, key);
+#else
+  ptree_it *it;
+  if (tree->multiset) {
+    // the first of the elements with the key
+    ptree_it *end;
+    ptree_equal_range(tree, key, &it, &end);
+    if (it == end) {
+      it = NULL;
+    }
+  } else {
+    it = ptree_get_it(tree, key);
+  }
   if (it) {
     ptree_remove_node(tree, (ptree_node *)it);
     return true;
   }
   return false;
-}
\ No newline at end of file
+#endif
+}
+
+void *ptree_pop_min(ptree *tree) {
+  ptree_node *node = tree->min;
+  if (!node) {
+    return NULL;
+  }
+  void *ptr = node->ptr;
+  ptree_remove_node(tree, node);
+  return ptr;
+}
+
+void *ptree_pop_max(ptree *tree) {
+  ptree_node *node = tree->max;
+  if (!node) {
+    return NULL;
+  }
+  void *ptr = node->ptr;
+  ptree_remove_node(tree, node);
+  return ptr;
+}
+
+// links the n nodes in the array, which are in order, in a balanced tree, that
+// replaces the one of tree. The nodes on the deepest level are red if it is not
+// the root, so all the paths have the same number of black nodes.
+static void link_balanced(ptree *tree, ptree_node **nodes, size_t n) {
+  tree->root = leaf;
+  tree->finger = leaf;
+  tree->min = n ? nodes[0] : NULL;
+  tree->max = n ? nodes[n - 1] : NULL;
+  if (n == 0) {
+    return;
+  }
+  int height = 0;
+  while (((size_t)2 << height) <= n) {
+    ++height;
+  }
+  // the ranges of the array still to link, and where to link their middle
+  struct {
+    size_t begin;
+    size_t end;
+    ptree_node *parent;
+    int dir;
+    int depth;
+  } stack[PTREE_MAX_HEIGHT + 1];
+  int top = 0;
+  stack[top].begin = 0;
+  stack[top].end = n;
+  stack[top].parent = leaf;
+  stack[top].dir = 0;
+  stack[top].depth = 0;
+  ++top;
+  while (top) {
+    --top;
+    size_t begin = stack[top].begin;
+    size_t end = stack[top].end;
+    ptree_node *parent = stack[top].parent;
+    int dir = stack[top].dir;
+    int depth = stack[top].depth;
+    size_t mid = begin + (end - begin) / 2;
+    ptree_node *x = nodes[mid];
+    x->links[0] = leaf;
+    x->links[1] = leaf;
+#if (PTREE_NO_PARENT_POINTERS == 0)
+    x->parent = parent;
+#endif
+    if (parent == leaf) {
+      tree->root = x;
+    } else {
+      parent->links[dir] = x;
+    }
+    if (depth == height && depth > 0) {
+      paint_red(x);
+    } else {
+      paint_black(x);
+    }
+    if (mid + 1 < end) {
+      assert(top <= PTREE_MAX_HEIGHT);
+      stack[top].begin = mid + 1;
+      stack[top].end = end;
+      stack[top].parent = x;
+      stack[top].dir = 1;
+      stack[top].depth = depth + 1;
+      ++top;
+    }
+    if (begin < mid) {
+      assert(top <= PTREE_MAX_HEIGHT);
+      stack[top].begin = begin;
+      stack[top].end = mid;
+      stack[top].parent = x;
+      stack[top].dir = 0;
+      stack[top].depth = depth + 1;
+      ++top;
+    }
+  }
+#if (PTREE_THREADED == 1)
+  for (size_t i = 0; i < n; ++i) {
+    nodes[i]->threads[0] = i > 0 ? nodes[i - 1] : NULL;
+    nodes[i]->threads[1] = i + 1 < n ? nodes[i + 1] : NULL;
+  }
+#endif
+}
+
+// batches with at least 1 / rebuild_fraction of the elements of the tree are
+// removed by linking the remaining nodes in a new balanced tree, instead of
+// one by one
+#define rebuild_fraction 4
+
+// releases a node that is being removed from a tree that will be rebuilt with
+// link_balanced, so its links do not need to be fixed
+static void drop_node(ptree *tree, ptree_node *node) {
+  if (tree->index) {
+    index_erase(tree, index_find_node(tree, node));
+  }
+  if (tree->bloom) {
+    ++(tree->bloom_removed);
+  }
+  release_node(tree, node);
+}
+
+// makes child the dir child of parent
+inline static void set_link(ptree_node *parent, int dir, ptree_node *child) {
+  parent->links[dir] = child;
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  if (child != leaf) {
+    child->parent = parent;
+  }
+#endif
+}
+
+// returns the number of black nodes on the paths from node to the leaves
+static int black_height(const ptree_node *node) {
+  int height = 0;
+  for (; node != leaf; node = node->links[0]) {
+    height += is_black(node);
+  }
+  return height;
+}
+
+// returns the root of a tree made of the subtrees rooted in l and r, whose
+// black heights are lh and rh, and of the node k, which goes between their
+// elements, and stores its black height in height. k is linked next to the
+// spine of the taller tree, where the black height is the same as the one of
+// the other tree, so this takes O(|lh - rh| + 1) time.
+static ptree_node *join(ptree_node *l, int lh, ptree_node *k, ptree_node *r,
+                        int rh, int *height) {
+  // with both roots black, the red k can only be under a red node
+  if (is_red(l)) {
+    paint_black(l);
+    ++lh;
+  }
+  if (is_red(r)) {
+    paint_black(r);
+    ++rh;
+  }
+  paint_red(k);
+  if (lh == rh) {
+    set_link(k, 0, l);
+    set_link(k, 1, r);
+    *height = lh;
+    return k;
+  }
+  // walk the right spine of l if it is taller, else the left spine of r
+  int dir = lh > rh;
+  ptree_node *root = dir ? l : r;
+  ptree_node *shorter = dir ? r : l;
+  int target = dir ? rh : lh;
+  *height = dir ? lh : rh;
+  ptree_node *spine[PTREE_MAX_HEIGHT];
+  int n = 0;
+  ptree_node *c = root;
+  for (int bh = *height; is_red(c) || bh != target; c = c->links[dir]) {
+    assert(n < PTREE_MAX_HEIGHT);
+    bh -= is_black(c);
+    spine[n++] = c;
+  }
+  set_link(k, !dir, c);
+  set_link(k, dir, shorter);
+  set_link(spine[n - 1], dir, k);
+  // a red node x under a red parent, whose parent is black, is painted black
+  // and the parent is lifted over the grandparent, which moves the red node
+  // two levels up
+  ptree_node *x = k;
+  int i = n - 1;
+  while (i > 0 && is_red(x) && is_red(spine[i])) {
+    ptree_node *p = spine[i];
+    ptree_node *g = spine[i - 1];
+    paint_black(x);
+    set_link(g, dir, p->links[!dir]);
+    set_link(p, !dir, g);
+    if (i > 1) {
+      set_link(spine[i - 2], dir, p);
+    } else {
+      root = p;
+    }
+    x = p;
+    i -= 2;
+  }
+  if (i == 0 && is_red(x) && is_red(root)) {
+    paint_black(root);
+    ++(*height);
+  }
+  return root;
+}
+
+// splits the subtree rooted in root, whose black height is height, in the
+// subtree of the elements less than key according to cmp, stored in l, and
+// the one of the other elements, stored in r, or, if lower is not set, in the
+// elements not greater than key and the others. Their black heights are stored
+// in lh and rh.
+static void split(ptree_node *root, int height, ptree_cmp_fptr cmp,
+                  const void *key, bool lower, ptree_node **l, int *lh,
+                  ptree_node **r, int *rh) {
+  ptree_node *path[PTREE_MAX_HEIGHT];
+  int heights[PTREE_MAX_HEIGHT];
+  // whether each node of the path goes to l, and the path goes on to its right
+  bool dirs[PTREE_MAX_HEIGHT];
+  int n = 0;
+  for (ptree_node *x = root; x != leaf; ++n) {
+    assert(n < PTREE_MAX_HEIGHT);
+    int diff = cmp(key, x->ptr);
+    path[n] = x;
+    heights[n] = height;
+    dirs[n] = lower ? diff > 0 : diff >= 0;
+    height -= is_black(x);
+    x = x->links[dirs[n]];
+  }
+  *l = leaf;
+  *r = leaf;
+  *lh = 0;
+  *rh = 0;
+  // from the bottom, each node of the path joins its subtree on the side
+  // opposite to the path to the part it belongs to
+  while (n--) {
+    ptree_node *x = path[n];
+    int child_height = heights[n] - is_black(x);
+    if (dirs[n]) {
+      *l = join(x->links[0], child_height, x, *l, *lh, lh);
+    } else {
+      *r = join(*r, *rh, x, x->links[1], child_height, rh);
+    }
+  }
+}
+
+// takes the maximum node out of the subtree rooted in root, whose black height
+// is height, and returns it. The subtree of the other nodes and its black
+// height are stored in rest and rest_height.
+static ptree_node *split_last(ptree_node *root, int height, ptree_node **rest,
+                              int *rest_height) {
+  ptree_node *path[PTREE_MAX_HEIGHT];
+  int heights[PTREE_MAX_HEIGHT];
+  int n = 0;
+  ptree_node *last = root;
+  while (has_child(last, 1)) {
+    assert(n < PTREE_MAX_HEIGHT);
+    path[n] = last;
+    heights[n++] = height;
+    height -= is_black(last);
+    last = last->links[1];
+  }
+  *rest = last->links[0];
+  *rest_height = height - is_black(last);
+  while (n--) {
+    ptree_node *x = path[n];
+    *rest = join(x->links[0], heights[n] - is_black(x), x, *rest, *rest_height,
+                 rest_height);
+  }
+  return last;
+}
+
+// returns the last node of the subtree rooted in node in direction dir, or NULL
+// if it is empty
+static ptree_node *subtree_extreme(ptree_node *node, int dir) {
+  if (node == leaf) {
+    return NULL;
+  }
+  while (has_child(node, dir)) {
+    node = node->links[dir];
+  }
+  return node;
+}
+
+// removes the elements from the first not less than min_key according to
+// cmp_key, or greater than it if min_inclusive is not set, to the last not
+// greater than max_key, or less than it if max_inclusive is not set, and
+// returns their number. A NULL key leaves the span unbounded on its side. The
+// tree is split in three around the span, whose nodes are released, and the
+// other two parts are joined again, so this takes O(log n + k) time for k
+// removed elements.
+static size_t remove_span(ptree *tree, const void *min_key, bool min_inclusive,
+                          const void *max_key, bool max_inclusive) {
+  if (tree->root == leaf) {
+    return 0;
+  }
+  // the kept elements before the span, the span and the kept elements after it
+  ptree_node *a = leaf;
+  ptree_node *m = tree->root;
+  ptree_node *c = leaf;
+  int ah = 0;
+  int mh = black_height(tree->root);
+  int ch = 0;
+  if (min_key) {
+    split(m, mh, tree->cmp_key, min_key, min_inclusive, &a, &ah, &m, &mh);
+  }
+  if (max_key) {
+    split(m, mh, tree->cmp_key, max_key, !max_inclusive, &m, &mh, &c, &ch);
+  }
+  size_t count = 0;
+  while (m != leaf) {
+    if (has_child(m, 0)) {
+      // lift the left child, so that the nodes are released without a stack
+      ptree_node *child = m->links[0];
+      m->links[0] = child->links[1];
+      child->links[1] = m;
+      m = child;
+    } else {
+      ptree_node *next = m->links[1];
+      drop_node(tree, m);
+      ++count;
+      m = next;
+    }
+  }
+  ptree_node *a_last = subtree_extreme(a, 1);
+  ptree_node *c_first = subtree_extreme(c, 0);
+  if (a == leaf) {
+    tree->min = c_first;
+  }
+  if (c == leaf) {
+    tree->max = a_last;
+  }
+  if (a == leaf || c == leaf) {
+    tree->root = a != leaf ? a : c;
+  } else {
+    ptree_node *rest;
+    int rest_height;
+    ptree_node *pivot = split_last(a, ah, &rest, &rest_height);
+    tree->root = join(rest, rest_height, pivot, c, ch, &ch);
+  }
+#if (PTREE_THREADED == 1)
+  if (a_last) {
+    a_last->threads[1] = c_first;
+  }
+  if (c_first) {
+    c_first->threads[0] = a_last;
+  }
+#endif
+  tree->finger = leaf;
+  if (tree->root != leaf) {
+    paint_black(tree->root);
+#if (PTREE_NO_PARENT_POINTERS == 0)
+    tree->root->parent = leaf;
+#endif
+  }
+  return count;
+}
+
+size_t ptree_remove_many(ptree *tree, const void **keys, size_t n) {
+  size_t size = tree->nodes_num;
+  size_t count = 0;
+  if (n * rebuild_fraction < size) {
+    // locate the keys in a single in-order pass, in which each lookup moves
+    // forward from the previous one, then unlink the found nodes, which keep
+    // their elements while the others are unlinked
+    ptree_node **found = malloc(n * sizeof(ptree_node *));
+    if (!found && n) {
+      oom();
+    }
+    ptree_cursor cursor;
+    for (size_t i = 0; i < n; ++i) {
+      ptree_it *it = i ? cursor_seek_forward(&cursor, tree->cmp_key, keys[i])
+                       : cursor_seek(tree, &cursor, tree->cmp_key, keys[0]);
+      if (!it) {
+        break;
+      }
+      if (tree->cmp_key(keys[i], it->ptr) == 0) {
+        // the next key, if equal, removes the next element
+        found[count++] = (ptree_node *)it;
+        cursor_step(&cursor, 1);
+      }
+    }
+    for (size_t i = 0; i < count; ++i) {
+      ptree_remove_node(tree, found[i]);
+    }
+    free(found);
+    return count;
+  }
+  // walk the tree and the keys together, and relink the nodes that are kept
+  ptree_node **kept = malloc(size * sizeof(ptree_node *));
+  if (!kept && size) {
+    oom();
+  }
+  size_t kept_num = 0;
+  size_t i = 0;
+  ptree_cursor cursor;
+  ptree_it *it = ptree_cursor_min(tree, &cursor);
+  while (it) {
+    ptree_node *node = (ptree_node *)it;
+    int diff = i < n ? tree->cmp_key(keys[i], node->ptr) : 1;
+    if (diff < 0) {
+      // no element with this key
+      ++i;
+      continue;
+    }
+    it = cursor_step(&cursor, 1);
+    if (diff == 0) {
+      drop_node(tree, node);
+      ++count;
+      ++i;
+    } else {
+      kept[kept_num++] = node;
+    }
+  }
+  if (count) {
+    link_balanced(tree, kept, kept_num);
+  }
+  free(kept);
+  return count;
+}
+
+size_t ptree_retain(ptree *tree, ptree_pred_fptr pred, void *ctx) {
+  size_t size = tree->nodes_num;
+  ptree_node **kept = malloc(size * sizeof(ptree_node *));
+  if (!kept && size) {
+    oom();
+  }
+  size_t kept_num = 0;
+  ptree_cursor cursor;
+  ptree_it *it = ptree_cursor_min(tree, &cursor);
+  while (it) {
+    ptree_node *node = (ptree_node *)it;
+    it = cursor_step(&cursor, 1);
+    if (pred(node->ptr, ctx)) {
+      kept[kept_num++] = node;
+    } else {
+      drop_node(tree, node);
+    }
+  }
+  if (kept_num < size) {
+    link_balanced(tree, kept, kept_num);
+  }
+  free(kept);
+  return size - kept_num;
+}
+
+size_t ptree_remove_range(ptree *tree, const void *min_key,
+                          const void *max_key) {
+  return remove_span(tree, min_key, true, max_key, true);
+}
+
+size_t ptree_remove_less_than(ptree *tree, const void *key) {
+  return remove_span(tree, NULL, false, key, false);
+}
+
+size_t ptree_remove_greater_than(ptree *tree, const void *key) {
+  return remove_span(tree, key, false, NULL, false);
+}
+
+// calls mutate on the element of x, whose position in the tree does not change
+static void mutate_in_place(ptree *tree, ptree_node *x,
+                            ptree_mutate_fptr mutate, void *ctx) {
+  // the index entry is found by the hash of the element, which may change
+  if (tree->index) {
+    index_erase(tree, index_find_node(tree, x));
+  }
+  mutate(x->ptr, ctx);
+  if (tree->index) {
+    index_add(tree, x);
+  }
+  if (tree->bloom) {
+    ++(tree->bloom_removed);
+    bloom_add(tree, x->ptr);
+  }
+}
+
+ptree_it *ptree_update(ptree *tree, ptree_it *it, const void *key,
+                       ptree_mutate_fptr mutate, void *ctx) {
+  ptree_node *x = (ptree_node *)it;
+  ptree_cmp_fptr cmp = tree->cmp_key;
+#if (PTREE_NO_PARENT_POINTERS == 1)
+  ptree_node *parent;
+  int dir;
+  ptree_node *found = locate(tree, cmp, key, &parent, &dir);
+  if (found) {
+    if (found != x) {
+      return NULL;
+    }
+    mutate_in_place(tree, x, mutate, ctx);
+    return it;
+  }
+  // the top-down removal finds the node by its key, so it must happen before
+  // the key changes, and add_node then takes back the node it released
+  void *ptr = x->ptr;
+  bool inserted;
+  remove_top_down(tree, tree->cmp, ptr);
+  mutate(ptr, ctx);
+  ptree_node *node = insert_node(tree, ptr, &inserted);
+  assert(inserted && node == x);
+  return (ptree_it *)node;
+#else
+  // equal elements are allowed next to each other only in a multiset, where
+  // the updated element goes after its equals, as if it were inserted again
+  ptree_node *prev = get_prev_node(x);
+  ptree_node *next = get_next_node(x);
+  int prev_diff = prev ? cmp(key, prev->ptr) : 1;
+  int next_diff = next ? cmp(key, next->ptr) : -1;
+  if (next_diff < 0 && (prev_diff > 0 || (prev_diff == 0 && tree->multiset))) {
+    mutate_in_place(tree, x, mutate, ctx);
+    return it;
+  }
+  if (!tree->multiset && (prev_diff == 0 || next_diff == 0)) {
+    return NULL;
+  }
+  // the side of x where key goes. As in search_start, climbs to the root of the
+  // lowest subtree that can contain key, then searches it for the position of
+  // key, skipping x, and checking that no other element has key in a set.
+  int dir = next_diff >= 0;
+  ptree_node *y = x;
+  while (y != tree->root) {
+    ptree_node *parent = y->parent;
+    if (y == parent->links[!dir]) {
+      int diff = cmp(key, parent->ptr);
+      if (diff == 0 && !tree->multiset) {
+        return NULL;
+      }
+      if ((diff >= 0) != dir) {
+        break;
+      }
+    }
+    y = parent;
+  }
+  ptree_node *parent = leaf;
+  int side = 0;
+  for (; y != leaf; y = y->links[side]) {
+    if (y == x) {
+      side = dir;
+    } else {
+      int diff = cmp(key, y->ptr);
+      if (diff == 0 && !tree->multiset) {
+        return NULL;
+      }
+      side = diff >= 0;
+    }
+    parent = y;
+  }
+  // the search ends next to the neighbour of x on the side of key or beyond,
+  // so parent is not x, and is still in the tree once x is unlinked, but the
+  // rebalancing may give it a child on that side, in which case key goes
+  // before the first node of that subtree
+  assert(parent != x);
+  unlink_node(tree, x);
+  mutate(x->ptr, ctx);
+  if (has_child(parent, side)) {
+    parent = side ? get_next_node(parent) : get_prev_node(parent);
+    side = !side;
+  }
+  x->links[0] = leaf;
+  x->links[1] = leaf;
+  paint_red(x);
+  link_existing(tree, parent, side, x);
+  return it;
+#endif
+}
+
+ptree_node_handle *ptree_extract(ptree *tree, ptree_it *it) {
+  ptree_node *node = (ptree_node *)it;
+  void *ptr = node->ptr;
+  ptree_remove_node(tree, node);
+  detach_node(tree, node);
+  node->ptr = ptr;
+  return (ptree_node_handle *)node;
+}
+
+ptree_it *ptree_insert_node(ptree *tree, ptree_node_handle *handle) {
+  ptree_node *node = (ptree_node *)handle;
+  void *ptr = node->ptr;
+  bool inserted;
+  adopt_node(tree, node);
+  // add_node takes the adopted node
+  ptree_node *x = insert_node(tree, ptr, &inserted);
+  if (!inserted) {
+    detach_node(tree, node);
+    return NULL;
+  }
+  assert(x == node);
+  return (ptree_it *)x;
+}
+
+void ptree_node_free(ptree_node_handle *handle) { free(handle); }
+
+size_t ptree_remove_all_by_key(ptree *tree, const void *key) {
+  return remove_span(tree, key, true, key, true);
+}
+
+/******************************************************
+ * merge
+ ******************************************************/
+
+struct ptree_merge {
+  ptree_cmp_fptr cmp;
+  size_t n;
+  bool dedup;
+  // the last returned element, used to skip the ones equal to it if dedup is
+  // set
+  void *last;
+  // a cursor and the current element, NULL at the end, for each tree
+  ptree_cursor *cursors;
+  void **heads;
+  // the loser tree: losers[0] is the tree with the least current element, and
+  // losers[i] for i > 0 is the tree that lost the match in internal node i,
+  // whose children are the nodes 2 * i and 2 * i + 1. The leaves are the nodes
+  // from n to 2 * n - 1, one for each tree.
+  size_t *losers;
+};
+
+// returns true if the current element of tree a comes before the one of tree
+// b. Trees at their end come last, and ties go to the first tree.
+static bool merge_beats(const ptree_merge *merge, size_t a, size_t b) {
+  void *x = merge->heads[a];
+  void *y = merge->heads[b];
+  if (!x || !y) {
+    return y == NULL && (x != NULL || a < b);
+  }
+  int diff = merge->cmp(x, y);
+  return diff < 0 || (diff == 0 && a < b);
+}
+
+ptree_merge *ptree_merge_new(ptree *const *trees, size_t n, int dedup) {
+  ptree_merge *merge = malloc(sizeof *merge);
+  if (!merge) {
+    oom();
+  }
+  memset(merge, 0, sizeof *merge);
+  merge->n = n;
+  merge->dedup = dedup != 0;
+  // with no trees, there is nothing to compare, and ptree_merge_next returns
+  // NULL straight away
+  if (n == 0) {
+    return merge;
+  }
+  merge->cmp = trees[0]->cmp;
+  merge->cursors = malloc(n * sizeof(ptree_cursor));
+  merge->heads = malloc(n * sizeof(void *));
+  merge->losers = malloc(n * sizeof(size_t));
+  // the winners of the matches, only needed to build the tree
+  size_t *winners = malloc(2 * n * sizeof(size_t));
+  if (!merge->cursors || !merge->heads || !merge->losers || !winners) {
+    oom();
+  }
+  for (size_t i = 0; i < n; ++i) {
+    ptree_it *it = ptree_cursor_min(trees[i], merge->cursors + i);
+    merge->heads[i] = it ? it->ptr : NULL;
+    winners[n + i] = i;
+  }
+  for (size_t i = n - 1; i > 0; --i) {
+    size_t a = winners[2 * i];
+    size_t b = winners[2 * i + 1];
+    bool a_wins = merge_beats(merge, a, b);
+    winners[i] = a_wins ? a : b;
+    merge->losers[i] = a_wins ? b : a;
+  }
+  merge->losers[0] = n > 1 ? winners[1] : 0;
+  free(winners);
+  return merge;
+}
+
+void ptree_merge_free(ptree_merge *merge) {
+  free(merge->cursors);
+  free(merge->heads);
+  free(merge->losers);
+  free(merge);
+}
+
+void *ptree_merge_next(ptree_merge *merge) {
+  if (merge->n == 0) {
+    return NULL;
+  }
+  while (true) {
+    size_t winner = merge->losers[0];
+    void *ptr = merge->heads[winner];
+    if (!ptr) {
+      return NULL;
+    }
+    ptree_it *it = ptree_cursor_next(merge->cursors + winner);
+    merge->heads[winner] = it ? it->ptr : NULL;
+    // replay the matches on the path from the leaf of the winner to the root
+    for (size_t i = (winner + merge->n) / 2; i > 0; i /= 2) {
+      if (merge_beats(merge, merge->losers[i], winner)) {
+        size_t loser = winner;
+        winner = merge->losers[i];
+        merge->losers[i] = loser;
+      }
+    }
+    merge->losers[0] = winner;
+    if (merge->dedup && merge->last && merge->cmp(ptr, merge->last) == 0) {
+      continue;
+    }
+    merge->last = ptr;
+    return ptr;
+  }
+}
+
+/******************************************************
+ * learned index
+ ******************************************************/
+
+struct ptree_learned {
+  // the keys and the elements of the tree, in order
+  int64_t *keys;
+  void **elems;
+  size_t size;
+  // segment i starts at position positions[i], where the key is
+  // segment_keys[i], and predicts the position of a key k as
+  // positions[i] + slopes[i] * (k - segment_keys[i]), with an error of at most
+  // max_error
+  int64_t *segment_keys;
+  size_t *positions;
+  double *slopes;
+  size_t segments_num;
+  size_t max_error;
+};
+
+// the distance from a to b, with b >= a. The subtraction is done on unsigned
+// integers, as keys spanning more than INT64_MAX would overflow it on signed
+// ones
+static double key_distance(int64_t a, int64_t b) {
+  return (double)((uint64_t)b - (uint64_t)a);
+}
+
+// builds the segments with the shrinking cone algorithm: each segment is
+// extended as long as there is a slope that predicts the positions of all its
+// keys within max_error
+static void learned_build_segments(ptree_learned *index) {
+  double error = (double)index->max_error;
+  size_t start = 0;
+  double lo = 0.0;
+  double hi = 0.0;
+  for (size_t i = 0; i <= index->size; ++i) {
+    if (i < index->size && i > start) {
+      double dx = key_distance(index->keys[start], index->keys[i]);
+      double dy = (double)(i - start);
+      double point_lo = (dy - error) / dx;
+      double point_hi = (dy + error) / dx;
+      if (i == start + 1) {
+        lo = point_lo;
+        hi = point_hi;
+        continue;
+      }
+      if (point_lo <= hi && point_hi >= lo) {
+        lo = point_lo > lo ? point_lo : lo;
+        hi = point_hi < hi ? point_hi : hi;
+        continue;
+      }
+    }
+    if (i > start) {
+      size_t s = index->segments_num++;
+      index->segment_keys[s] = index->keys[start];
+      index->positions[s] = start;
+      index->slopes[s] = i > start + 1 ? 0.5 * (lo + hi) : 0.0;
+    }
+    start = i;
+  }
+}
+
+ptree_learned *ptree_learned_new(const ptree *tree, ptree_int_key_fptr key_of,
+                                 size_t max_error) {
+  ptree_learned *index = malloc(sizeof *index);
+  if (!index) {
+    oom();
+  }
+  memset(index, 0, sizeof *index);
+  size_t size = tree->nodes_num;
+  index->size = size;
+  index->max_error = max_error;
+  if (size == 0) {
+    return index;
+  }
+  index->keys = malloc(size * sizeof(int64_t));
+  index->elems = malloc(size * sizeof(void *));
+  index->segment_keys = malloc(size * sizeof(int64_t));
+  index->positions = malloc(size * sizeof(size_t));
+  index->slopes = malloc(size * sizeof(double));
+  if (!index->keys || !index->elems || !index->segment_keys ||
+      !index->positions || !index->slopes) {
+    oom();
+  }
+  ptree_cursor cursor;
+  ptree_it *it = ptree_cursor_min(tree, &cursor);
+  for (size_t i = 0; i < size; ++i) {
+    index->elems[i] = it->ptr;
+    index->keys[i] = key_of(it->ptr);
+    it = ptree_cursor_next(&cursor);
+  }
+  learned_build_segments(index);
+  // there can be a segment for each element, but nearly uniform keys take only
+  // a few, so the model is shrunk to its actual size
+  size_t segments_num = index->segments_num;
+  int64_t *segment_keys =
+      realloc(index->segment_keys, segments_num * sizeof(int64_t));
+  size_t *positions = realloc(index->positions, segments_num * sizeof(size_t));
+  double *slopes = realloc(index->slopes, segments_num * sizeof(double));
+  if (!segment_keys || !positions || !slopes) {
+    oom();
+  }
+  index->segment_keys = segment_keys;
+  index->positions = positions;
+  index->slopes = slopes;
+  return index;
+}
+
+void ptree_learned_free(ptree_learned *index) {
+  free(index->keys);
+  free(index->elems);
+  free(index->segment_keys);
+  free(index->positions);
+  free(index->slopes);
+  free(index);
+}
+
+void *ptree_learned_get(const ptree_learned *index, int64_t key) {
+  if (index->size == 0 || key < index->keys[0] ||
+      key > index->keys[index->size - 1]) {
+    return NULL;
+  }
+  // the last segment starting at or before key
+  size_t lo = 0;
+  size_t hi = index->segments_num;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->segment_keys[mid] <= key) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  size_t segment_begin = index->positions[lo];
+  size_t segment_end = lo + 1 < index->segments_num ? index->positions[lo + 1]
+                                                    : index->size;
+  double predicted =
+      (double)segment_begin +
+      index->slopes[lo] * key_distance(index->segment_keys[lo], key);
+  // the key is within max_error (plus rounding) from the prediction
+  double first = predicted - (double)index->max_error - 1.0;
+  double last = predicted + (double)index->max_error + 2.0;
+  if (first < (double)segment_begin) {
+    first = (double)segment_begin;
+  }
+  if (last > (double)segment_end) {
+    last = (double)segment_end;
+  }
+  if (first >= last) {
+    return NULL;
+  }
+  lo = (size_t)first;
+  hi = (size_t)last;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->keys[mid] < key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < segment_end && index->keys[lo] == key) {
+    return index->elems[lo];
+  }
+  return NULL;
+}
@@ -40,6 +40,27 @@ For more information, please refer to <http://unlicense.org/>
 #define PTREE_STORAGE_64BIT 0
 #endif
 
+// define this macro to 1 to keep in each node pointers to the previous and the
+// next node, so that ptree_it_next and ptree_it_prev are a single pointer load,
+// at the cost of 2 more pointers per node and of their upkeep
+#ifndef PTREE_THREADED
+#define PTREE_THREADED 0
+#endif
+
+// define this macro to 1 to drop the parent pointer from the nodes, making
+// insertion and removal top-down. Finger search, hints, multisets and, unless
+// PTREE_THREADED is 1, ptree_it_next and ptree_it_prev are then not available.
+#ifndef PTREE_NO_PARENT_POINTERS
+#define PTREE_NO_PARENT_POINTERS 0
+#endif
+
+// the maximum height of a tree
+#if (PTREE_STORAGE_64BIT == 1)
+#define PTREE_MAX_HEIGHT 128
+#else
+#define PTREE_MAX_HEIGHT 64
+#endif
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -52,9 +73,54 @@ typedef struct ptree_it {
   void *ptr;
 } ptree_it;
 
+// a node taken out of a tree by ptree_extract, which holds its element, and can
+// be linked to another tree with ptree_insert_node.
+typedef struct ptree_node_handle {
+  void *ptr;
+} ptree_node_handle;
+
+// a stack based iterator, which holds the path from the root to the current
+// node, so it needs no parent pointers. It is invalidated by any change to the
+// tree.
+typedef struct ptree_cursor {
+  ptree_it *path[PTREE_MAX_HEIGHT];
+  int32_t depth;
+} ptree_cursor;
+
 // the type for the ordering functions
 typedef int (*ptree_cmp_fptr)(const void *a, const void *b);
 
+// the type for the functions called on each element by ptree_foreach, they
+// return 0 to continue the traversal, anything else to stop it
+typedef int (*ptree_visit_fptr)(void *ptr, void *ctx);
+
+// the type for the predicates of ptree_retain, they return 0 for the elements
+// to remove, anything else for those to keep
+typedef int (*ptree_pred_fptr)(const void *ptr, void *ctx);
+
+// the type for the functions that change the key of an element in
+// ptree_update
+typedef void (*ptree_mutate_fptr)(void *ptr, void *ctx);
+
+// the type for the functions called on each element by ptree_clear_with and
+// ptree_free_with
+typedef void (*ptree_destroy_fptr)(void *ptr, void *ctx);
+
+// the type for the functions that make an element with the given key
+typedef void *(*ptree_make_fptr)(const void *key, void *ctx);
+
+// the type for the hash functions
+typedef uint64_t (*ptree_hash_fptr)(const void *key);
+
+// the type for the functions that return the integer key of an element
+typedef int64_t (*ptree_int_key_fptr)(const void *elem);
+
+// the learned index struct
+typedef struct ptree_learned ptree_learned;
+
+// the struct to iterate many trees at once
+typedef struct ptree_merge ptree_merge;
+
 // creates a tree. `cmp_elem` is the ordering function, `cmp_key` is the
 // optional function to use keys, `preallocated_nodes` is the number of elements
 // to preallocate memory for
@@ -64,41 +130,199 @@ ptree *ptree_new(ptree_cmp_fptr cmp_elem, ptree_cmp_fptr cmp_key,
 // frees a tree
 void ptree_free(ptree *tree);
 
+// creates a copy of a tree, with the same elements, which are not copied, and
+// the same settings and shape, in O(n) time without comparisons. Each node of
+// the copy is allocated on its own, so the copy is not contiguous in memory.
+ptree *ptree_clone(const ptree *tree);
+
 // drops all elements, but keeps the allocated space
 void ptree_empty(ptree *tree);
 
+// calls fn(ptr, ctx) on each element of the tree, for example to free it, in
+// no particular order, and then drops all elements, like ptree_empty. fn must
+// not access the tree.
+void ptree_clear_with(ptree *tree, ptree_destroy_fptr fn, void *ctx);
+
+// calls fn(ptr, ctx) on each element of the tree, as ptree_clear_with, and then
+// frees the tree
+void ptree_free_with(ptree *tree, ptree_destroy_fptr fn, void *ctx);
+
 // free unused memory
 void ptree_shrink(ptree *tree);
 
+#if (PTREE_NO_PARENT_POINTERS == 0)
+
+// makes the tree a multiset, which accepts elements equal to the ones already
+// in it, and inserts each element after those equal to it, so equal elements
+// keep their insertion order. Must be called while the tree is empty.
+void ptree_set_multiset(ptree *tree, int enabled);
+
+#endif
+
+// returns 1 if the tree is a multiset, else 0
+int ptree_get_multiset(const ptree *tree);
+
+// bounds the size of the tree, which must not be larger, to capacity, or
+// removes the bound if it is 0. Over it, ptree_insert and ptree_insert_evict
+// evict the maximum element if evict_max is not 0, else the minimum one.
+void ptree_set_capacity(ptree *tree, size_t capacity, int evict_max);
+
+// returns the maximum number of elements of the tree, or 0 if it is unbounded
+size_t ptree_get_capacity(const ptree *tree);
+
 // insert an element in the tree and returns 1 if ptr was not already in the
-// tree, 0 if it was already there
+// tree, 0 if it was already there. A multiset always inserts ptr. With a
+// capacity, this is ptree_insert_evict, returning 0 if ptr is evicted at once.
 int ptree_insert(ptree *tree, void *ptr);
 
+// inserts an element in the tree, evicting one if the tree is over its
+// capacity. Returns the evicted element, or ptr if it was not inserted, or
+// NULL. A ptr that would be evicted right away costs a single comparison.
+void *ptree_insert_evict(ptree *tree, void *ptr);
+
+// insert an element in the tree, in a single descent, if it is not already
+// there, and stores in out, if it is not NULL, an iterator to the element of
+// the tree equal to ptr. Returns 1 if ptr was inserted, else 0.
+int ptree_insert_or_get(ptree *tree, void *ptr, ptree_it **out);
+
+// like ptree_insert_or_get, but if there is no element with the given key,
+// inserts the element returned by make(key, ctx), which must have that key.
+// make is only called if the key is not in the tree.
+int ptree_insert_or_get_by_key(ptree *tree, const void *key,
+                               ptree_make_fptr make, void *ctx,
+                               ptree_it **out);
+
+// insert an element in the tree next to hint, or at the end if hint is NULL, if
+// it belongs there, else as ptree_insert. Returns an iterator to ptr, or to the
+// element of the tree equal to it, if there was one already
+ptree_it *ptree_insert_hint(ptree *tree, ptree_it *hint, void *ptr);
+
 // removes an element from the tree, and returns 1 if it was removed, 0 if it
-// was not contained in tree to begin with
+// was not contained in tree to begin with. In a multiset, only ptr itself is
+// removed, not the elements equal to it.
 int ptree_remove(ptree *tree, const void *ptr);
 
 // searches the tree for an element with the given key, removes it from the tree
-// and returns 1 if the element exists, else returns 0
+// and returns 1 if the element exists, else returns 0. In a multiset, the first
+// element with the key is removed.
 int ptree_remove_by_key(ptree *tree, void *key);
 
-// removes from the tree the element corresponding to the iterator it
-void ptree_remove_by_it(ptree *tree, ptree_it *it);
-
-// returns an iterator to the inorder minimum element of the tree
+// removes all the elements with the given key, and returns their number
+size_t ptree_remove_all_by_key(ptree *tree, const void *key);
+
+// removes the elements for which pred(ptr, ctx) returns 0, and returns their
+// number. pred is called once on each element, in order, and must not modify
+// the tree or the elements. Takes O(n) time however many elements are removed.
+size_t ptree_retain(ptree *tree, ptree_pred_fptr pred, void *ctx);
+
+// removes the elements with the n given keys, which must be sorted in ascending
+// order, and returns the number of removed elements. Each key removes at most
+// one element, as ptree_remove_by_key.
+size_t ptree_remove_many(ptree *tree, const void **keys, size_t n);
+
+// calls mutate(it->ptr, ctx) to change the key of the element to key, and
+// moves its node to its new position. If the tree is not a multiset and another
+// element has key, does nothing and returns NULL, else returns it.
+ptree_it *ptree_update(ptree *tree, ptree_it *it, const void *key,
+                       ptree_mutate_fptr mutate, void *ctx);
+
+// removes the element of the iterator it from the tree and returns its node,
+// which is not freed, so that it can be linked to another tree with
+// ptree_insert_node, without allocating a new one.
+ptree_node_handle *ptree_extract(ptree *tree, ptree_it *it);
+
+// links a node returned by ptree_extract to the tree, which takes ownership of
+// it, and returns an iterator to its element, or NULL, leaving the node to the
+// caller, if the tree is not a multiset and already holds an equal element.
+ptree_it *ptree_insert_node(ptree *tree, ptree_node_handle *node);
+
+// frees a node returned by ptree_extract
+void ptree_node_free(ptree_node_handle *node);
+
+// removes the elements with keys between min_key and max_key, both included,
+// and returns their number. A NULL key leaves the range unbounded on that
+// side. Takes O(log n + k) time for k removed elements.
+size_t ptree_remove_range(ptree *tree, const void *min_key,
+                          const void *max_key);
+
+// removes the elements with keys less than key, and returns their number. See
+// ptree_remove_range.
+size_t ptree_remove_less_than(ptree *tree, const void *key);
+
+// removes the elements with keys greater than key, and returns their number.
+// See ptree_remove_range.
+size_t ptree_remove_greater_than(ptree *tree, const void *key);
+
+// removes from the tree the element corresponding to the iterator it, and
+// returns an iterator to the next element, or NULL if it was the last one, so
+// that elements can be removed while iterating the tree
+ptree_it *ptree_remove_by_it(ptree *tree, ptree_it *it);
+
+// returns an iterator to the inorder minimum element of the tree. The tree
+// keeps track of it, so this takes constant time.
 ptree_it *ptree_min(ptree *tree);
 
-// returns an iterator to the inorder maximum element of the tree
+// returns an iterator to the inorder maximum element of the tree. The tree
+// keeps track of it, so this takes constant time.
 ptree_it *ptree_max(ptree *tree);
 
+// removes the inorder minimum element from the tree and returns it, or returns
+// NULL if the tree is empty
+void *ptree_pop_min(ptree *tree);
+
+// removes the inorder maximum element from the tree and returns it, or returns
+// NULL if the tree is empty
+void *ptree_pop_max(ptree *tree);
+
+#if (PTREE_NO_PARENT_POINTERS == 0 || PTREE_THREADED == 1)
+
 // increment and iterator
 ptree_it *ptree_it_next(ptree_it *it);
 
 // decremente an iterator
 ptree_it *ptree_it_prev(ptree_it *it);
 
+#endif
+
+// sets the cursor on the inorder minimum element of the tree and returns an
+// iterator to it, or NULL if the tree is empty
+ptree_it *ptree_cursor_min(const ptree *tree, ptree_cursor *cursor);
+
+// sets the cursor on the inorder maximum element of the tree and returns an
+// iterator to it, or NULL if the tree is empty
+ptree_it *ptree_cursor_max(const ptree *tree, ptree_cursor *cursor);
+
+// moves the cursor to the next element and returns an iterator to it, or NULL
+// at the end of the tree
+ptree_it *ptree_cursor_next(ptree_cursor *cursor);
+
+// moves the cursor to the previous element and returns an iterator to it, or
+// NULL at the beginning of the tree
+ptree_it *ptree_cursor_prev(ptree_cursor *cursor);
+
+// copies in buf the element the cursor is on, and the following ones, up to n
+// elements, and moves the cursor past the last copied one. Returns the number
+// of copied elements, which is less than n only at the end of the tree.
+size_t ptree_export(ptree_cursor *cursor, void **buf, size_t n);
+
+// copies all the elements of the tree in buf, in order, and returns their
+// number. buf must have room for ptree_size(tree) elements.
+size_t ptree_export_all(const ptree *tree, void **buf);
+
+// calls fn(ptr, ctx) on each element of the tree, in order, until fn returns
+// something other than 0. Returns 1 if fn stopped the traversal, else 0. fn
+// must not modify the tree.
+int ptree_foreach(const ptree *tree, ptree_visit_fptr fn, void *ctx);
+
+// like ptree_foreach, but only visits the elements with keys between min_key
+// and max_key, both included. A NULL min_key or max_key leaves the range
+// unbounded on that side.
+int ptree_foreach_range(const ptree *tree, const void *min_key,
+                        const void *max_key, ptree_visit_fptr fn, void *ctx);
+
 // searches the tree for the given element, and returns and iterator to it if it
-// exists, else it returns NULL
+// exists, else it returns NULL. In a multiset, only ptr itself is searched for,
+// not the elements equal to it.
 ptree_it *ptree_has(const ptree *tree, const void *ptr);
 
 // searches the tree for an element with the given tree, and returns it it
@@ -106,9 +330,57 @@ ptree_it *ptree_has(const ptree *tree, const void *ptr);
 void *ptree_get(const ptree *tree, const void *key);
 
 // searches the tree for an element with the given tree, and returns an iterator
-// ot it if it exists, else it returns NULL
+// ot it if it exists, else it returns NULL. In a multiset, this can be any of
+// the elements with the key: use ptree_equal_range to get all of them.
 ptree_it *ptree_get_it(const ptree *tree, const void *key);
 
+// stores in begin an iterator to the first element with the given key, and in
+// end one to the element after the last one with the key, or NULL at the end
+// of the tree. If there is no element with the key, begin and end are equal.
+void ptree_equal_range(const ptree *tree, const void *key, ptree_it **begin,
+                       ptree_it **end);
+
+// returns the number of elements with the given key
+size_t ptree_count(const ptree *tree, const void *key);
+
+// searches the tree for the elements with the n given keys, and stores in
+// out[i] the element with key keys[i] if it exists, else NULL. The lookups are
+// interleaved so that their cache misses overlap.
+void ptree_get_many(const ptree *tree, const void **keys, size_t n,
+                    void **out);
+
+// like ptree_get_many, but the keys must be sorted in ascending order. Each
+// lookup climbs from where the previous one ended only as far as needed,
+// instead of starting from the root
+void ptree_get_many_sorted(const ptree *tree, const void **keys, size_t n,
+                           void **out);
+
+// enables or disables finger search: searches start from the last accessed
+// node, climbing only as far as needed. Searches then modify the tree, even a
+// const one. Does nothing if PTREE_NO_PARENT_POINTERS is 1.
+void ptree_set_finger_search(ptree *tree, int enabled);
+
+// returns 1 if finger search is enabled, else 0
+int ptree_get_finger_search(const ptree *tree);
+
+// enables a direct-mapped cache of num_entries (rounded up to a power of 2)
+// hashes of keys and nodes in front of ptree_get and ptree_get_it. Lookups then
+// modify the tree, even a const one. A NULL hash_key or 0 entries disables it.
+void ptree_set_lookup_cache(ptree *tree, ptree_hash_fptr hash_key,
+                            size_t num_entries);
+
+// makes the tree maintain a hash table of its nodes, used by ptree_has,
+// ptree_remove and, if hash_key is not NULL, by the lookups by key. hash_key of
+// a key must equal hash_elem of its element. A NULL hash_elem disables it.
+void ptree_set_hash_index(ptree *tree, ptree_hash_fptr hash_elem,
+                          ptree_hash_fptr hash_key);
+
+// makes the tree maintain a bloom filter of its elements, checked before the
+// searches as the hash index of ptree_set_hash_index is used. Lookups can then
+// modify the tree, even a const one. A NULL hash_elem disables it.
+void ptree_set_bloom_filter(ptree *tree, ptree_hash_fptr hash_elem,
+                            ptree_hash_fptr hash_key);
+
 // returns the number of elements in the tree
 int32_t ptree_size(const ptree *tree);
 
@@ -123,10 +395,58 @@ void ptree_set_max_nodes_to_auto_allocate(size_t num);
 // single call to ptree_insert. 0 means that there is no maximum number.
 size_t ptree_get_max_nodes_to_auto_allocate(void);
 
+// creates a read only snapshot of a tree whose integer keys, given by key_of,
+// are strictly increasing, with a piecewise linear model of the position of
+// each key, off by at most max_error. Later changes to the tree do not show.
+ptree_learned *ptree_learned_new(const ptree *tree, ptree_int_key_fptr key_of,
+                                 size_t max_error);
+
+// frees a learned index
+void ptree_learned_free(ptree_learned *index);
+
+// searches the learned index for an element with the given key, and returns it
+// if it exists, else it returns NULL
+void *ptree_learned_get(const ptree_learned *index, int64_t key);
+
+// creates an iterator that returns in order the elements of the n trees, which
+// must have the same ordering and not change while they are merged. Equal
+// elements come in the order of their trees, or only the first if dedup is set.
+ptree_merge *ptree_merge_new(ptree *const *trees, size_t n, int dedup);
+
+// returns the next element of the merged trees, or NULL at the end
+void *ptree_merge_next(ptree_merge *merge);
+
+// frees a merge iterator
+void ptree_merge_free(ptree_merge *merge);
+
 /******************************************************
  * macro to define strictly typed APIs
  ******************************************************/
 
+#if (PTREE_NO_PARENT_POINTERS == 0 || PTREE_THREADED == 1)
+#define DEFINE_TYPED_PTREE_IT_STEPS_OF(type)                                   \
+  static inline ptree_of_##type##_it *ptree_it_next__##type(                   \
+      ptree_of_##type##_it *it) {                                              \
+    return (ptree_of_##type##_it *)ptree_it_next((ptree_it *)it);              \
+  }                                                                            \
+  static inline ptree_of_##type##_it *ptree_it_prev__##type(                   \
+      ptree_of_##type##_it *it) {                                              \
+    return (ptree_of_##type##_it *)ptree_it_prev((ptree_it *)it);              \
+  }
+#else
+#define DEFINE_TYPED_PTREE_IT_STEPS_OF(type)
+#endif
+
+#if (PTREE_NO_PARENT_POINTERS == 0)
+#define DEFINE_TYPED_PTREE_MULTISET_OF(type)                                   \
+  static inline void ptree_set_multiset__##type(ptree_of_##type *tree,         \
+                                                int enabled) {                 \
+    ptree_set_multiset((ptree *)tree, enabled);                                \
+  }
+#else
+#define DEFINE_TYPED_PTREE_MULTISET_OF(type)
+#endif
+
 #define DEFINE_TYPED_PTREE_OF(type, key_type)                                  \
   typedef struct ptree_of_##type {                                             \
     ptree_it *root;                                                            \
@@ -134,6 +454,9 @@ size_t ptree_get_max_nodes_to_auto_allocate(void);
   typedef struct ptree_of_##type##_it {                                        \
     type *ptr;                                                                 \
   } ptree_of_##type##_it;                                                      \
+  typedef struct ptree_of_##type##_node {                                      \
+    type *ptr;                                                                 \
+  } ptree_of_##type##_node;                                                    \
   static inline ptree_of_##type *ptree_new__##type(                            \
       ptree_cmp_fptr cmp_elem, ptree_cmp_fptr cmp_key,                         \
       int32_t preallocated_nodes) {                                            \
@@ -143,6 +466,19 @@ size_t ptree_get_max_nodes_to_auto_allocate(void);
   static inline void ptree_free__##type(ptree_of_##type *tree) {               \
     ptree_free((ptree *)tree);                                                 \
   }                                                                            \
+  static inline ptree_of_##type *ptree_clone__##type(                          \
+      const ptree_of_##type *tree) {                                           \
+    return (ptree_of_##type *)ptree_clone((const ptree *)tree);                \
+  }                                                                            \
+  static inline void ptree_clear_with__##type(                                 \
+      ptree_of_##type *tree, ptree_destroy_fptr fn, void *ctx) {               \
+    ptree_clear_with((ptree *)tree, fn, ctx);                                  \
+  }                                                                            \
+  static inline void ptree_free_with__##type(ptree_of_##type *tree,            \
+                                             ptree_destroy_fptr fn,            \
+                                             void *ctx) {                      \
+    ptree_free_with((ptree *)tree, fn, ctx);                                   \
+  }                                                                            \
   static inline ptree_of_##type##_it *ptree_min__##type(                       \
       ptree_of_##type *tree) {                                                 \
     return (ptree_of_##type##_it *)ptree_min((ptree *)tree);                   \
@@ -151,17 +487,71 @@ size_t ptree_get_max_nodes_to_auto_allocate(void);
       ptree_of_##type *tree) {                                                 \
     return (ptree_of_##type##_it *)ptree_max((ptree *)tree);                   \
   }                                                                            \
-  static inline ptree_of_##type##_it *ptree_it_next__##type(                   \
-      ptree_of_##type##_it *it) {                                              \
-    return (ptree_of_##type##_it *)ptree_it_next((ptree_it *)it);              \
+  static inline type *ptree_pop_min__##type(ptree_of_##type *tree) {           \
+    return (type *)ptree_pop_min((ptree *)tree);                               \
   }                                                                            \
-  static inline ptree_of_##type##_it *ptree_it_prev__##type(                   \
-      ptree_of_##type##_it *it) {                                              \
-    return (ptree_of_##type##_it *)ptree_it_prev((ptree_it *)it);              \
+  static inline type *ptree_pop_max__##type(ptree_of_##type *tree) {           \
+    return (type *)ptree_pop_max((ptree *)tree);                               \
+  }                                                                            \
+  DEFINE_TYPED_PTREE_IT_STEPS_OF(type)                                         \
+  static inline ptree_of_##type##_it *ptree_cursor_min__##type(                \
+      const ptree_of_##type *tree, ptree_cursor *cursor) {                     \
+    return (ptree_of_##type##_it *)ptree_cursor_min((const ptree *)tree,       \
+                                                    cursor);                   \
+  }                                                                            \
+  static inline ptree_of_##type##_it *ptree_cursor_max__##type(                \
+      const ptree_of_##type *tree, ptree_cursor *cursor) {                     \
+    return (ptree_of_##type##_it *)ptree_cursor_max((const ptree *)tree,       \
+                                                    cursor);                   \
+  }                                                                            \
+  static inline ptree_of_##type##_it *ptree_cursor_next__##type(               \
+      ptree_cursor *cursor) {                                                  \
+    return (ptree_of_##type##_it *)ptree_cursor_next(cursor);                  \
+  }                                                                            \
+  static inline ptree_of_##type##_it *ptree_cursor_prev__##type(               \
+      ptree_cursor *cursor) {                                                  \
+    return (ptree_of_##type##_it *)ptree_cursor_prev(cursor);                  \
   }                                                                            \
   static inline int ptree_insert__##type(ptree_of_##type *tree, type *ptr) {   \
     return ptree_insert((ptree *)tree, ptr);                                   \
   }                                                                            \
+  static inline type *ptree_insert_evict__##type(ptree_of_##type *tree,        \
+                                                type *ptr) {                   \
+    return (type *)ptree_insert_evict((ptree *)tree, ptr);                     \
+  }                                                                            \
+  static inline int ptree_insert_or_get__##type(                               \
+      ptree_of_##type *tree, type *ptr, ptree_of_##type##_it **out) {          \
+    return ptree_insert_or_get((ptree *)tree, ptr, (ptree_it **)out);          \
+  }                                                                            \
+  static inline int ptree_insert_or_get_by_key__##type(                        \
+      ptree_of_##type *tree, const key_type *key, ptree_make_fptr make,        \
+      void *ctx, ptree_of_##type##_it **out) {                                 \
+    return ptree_insert_or_get_by_key((ptree *)tree, key, make, ctx,           \
+                                      (ptree_it **)out);                       \
+  }                                                                            \
+  static inline ptree_of_##type##_it *ptree_insert_hint__##type(               \
+      ptree_of_##type *tree, ptree_of_##type##_it *hint, type *ptr) {          \
+    return (ptree_of_##type##_it *)ptree_insert_hint(                          \
+        (ptree *)tree, (ptree_it *)hint, ptr);                                 \
+  }                                                                            \
+  static inline size_t ptree_export__##type(ptree_cursor *cursor, type **buf,  \
+                                            size_t n) {                        \
+    return ptree_export(cursor, (void **)buf, n);                              \
+  }                                                                            \
+  static inline size_t ptree_export_all__##type(const ptree_of_##type *tree,   \
+                                                type **buf) {                  \
+    return ptree_export_all((const ptree *)tree, (void **)buf);                \
+  }                                                                            \
+  static inline int ptree_foreach__##type(const ptree_of_##type *tree,         \
+                                          ptree_visit_fptr fn, void *ctx) {    \
+    return ptree_foreach((const ptree *)tree, fn, ctx);                        \
+  }                                                                            \
+  static inline int ptree_foreach_range__##type(                               \
+      const ptree_of_##type *tree, const key_type *min_key,                    \
+      const key_type *max_key, ptree_visit_fptr fn, void *ctx) {               \
+    return ptree_foreach_range((const ptree *)tree, min_key, max_key, fn,      \
+                               ctx);                                           \
+  }                                                                            \
   static inline ptree_of_##type##_it *ptree_has__##type(                       \
       const ptree_of_##type *tree, const type *ptr) {                          \
     return (ptree_of_##type##_it *)ptree_has((const ptree *)tree, ptr);        \
@@ -174,6 +564,27 @@ size_t ptree_get_max_nodes_to_auto_allocate(void);
       const ptree_of_##type *tree, const key_type *key) {                      \
     return (ptree_of_##type##_it *)ptree_get_it((const ptree *)tree, key);     \
   }                                                                            \
+  static inline void ptree_equal_range__##type(                                \
+      const ptree_of_##type *tree, const key_type *key,                        \
+      ptree_of_##type##_it **begin, ptree_of_##type##_it **end) {              \
+    ptree_equal_range((const ptree *)tree, key, (ptree_it **)begin,            \
+                      (ptree_it **)end);                                       \
+  }                                                                            \
+  static inline size_t ptree_count__##type(const ptree_of_##type *tree,        \
+                                           const key_type *key) {              \
+    return ptree_count((const ptree *)tree, key);                              \
+  }                                                                            \
+  static inline void ptree_get_many__##type(const ptree_of_##type *tree,       \
+                                            const key_type **keys, size_t n,   \
+                                            type **out) {                      \
+    ptree_get_many((const ptree *)tree, (const void **)keys, n, (void **)out); \
+  }                                                                            \
+  static inline void ptree_get_many_sorted__##type(                            \
+      const ptree_of_##type *tree, const key_type **keys, size_t n,            \
+      type **out) {                                                            \
+    ptree_get_many_sorted((const ptree *)tree, (const void **)keys, n,         \
+                          (void **)out);                                       \
+  }                                                                            \
   static inline void ptree_empty__##type(ptree_of_##type *tree) {              \
     ptree_empty((ptree *)tree);                                                \
   }                                                                            \
@@ -185,9 +596,88 @@ size_t ptree_get_max_nodes_to_auto_allocate(void);
                                                 key_type *key) {               \
     return ptree_remove_by_key((ptree *)tree, key);                            \
   }                                                                            \
-  static inline void ptree_remove_by_it__##type(ptree_of_##type *tree,         \
-                                                ptree_of_##type##_it *it) {    \
-    return ptree_remove_by_it((ptree *)tree, (ptree_it *)it);                  \
+  static inline size_t ptree_remove_all_by_key__##type(ptree_of_##type *tree,  \
+                                                       const key_type *key) {  \
+    return ptree_remove_all_by_key((ptree *)tree, key);                        \
+  }                                                                            \
+  static inline size_t ptree_retain__##type(ptree_of_##type *tree,             \
+                                            ptree_pred_fptr pred, void *ctx) { \
+    return ptree_retain((ptree *)tree, pred, ctx);                             \
+  }                                                                            \
+  static inline size_t ptree_remove_many__##type(                              \
+      ptree_of_##type *tree, const key_type **keys, size_t n) {                \
+    return ptree_remove_many((ptree *)tree, (const void **)keys, n);           \
+  }                                                                            \
+  static inline ptree_of_##type##_it *ptree_update__##type(                    \
+      ptree_of_##type *tree, ptree_of_##type##_it *it, const key_type *key,    \
+      ptree_mutate_fptr mutate, void *ctx) {                                   \
+    return (ptree_of_##type##_it *)ptree_update(                               \
+        (ptree *)tree, (ptree_it *)it, key, mutate, ctx);                      \
+  }                                                                            \
+  static inline ptree_of_##type##_node *ptree_extract__##type(                 \
+      ptree_of_##type *tree, ptree_of_##type##_it *it) {                       \
+    return (ptree_of_##type##_node *)ptree_extract((ptree *)tree,              \
+                                                   (ptree_it *)it);            \
+  }                                                                            \
+  static inline ptree_of_##type##_it *ptree_insert_node__##type(               \
+      ptree_of_##type *tree, ptree_of_##type##_node *node) {                   \
+    return (ptree_of_##type##_it *)ptree_insert_node(                          \
+        (ptree *)tree, (ptree_node_handle *)node);                             \
+  }                                                                            \
+  static inline void ptree_node_free__##type(ptree_of_##type##_node *node) {   \
+    ptree_node_free((ptree_node_handle *)node);                                \
+  }                                                                            \
+  static inline size_t ptree_remove_range__##type(                             \
+      ptree_of_##type *tree, const key_type *min_key,                          \
+      const key_type *max_key) {                                               \
+    return ptree_remove_range((ptree *)tree, min_key, max_key);                \
+  }                                                                            \
+  static inline size_t ptree_remove_less_than__##type(ptree_of_##type *tree,   \
+                                                      const key_type *key) {   \
+    return ptree_remove_less_than((ptree *)tree, key);                         \
+  }                                                                            \
+  static inline size_t ptree_remove_greater_than__##type(                      \
+      ptree_of_##type *tree, const key_type *key) {                            \
+    return ptree_remove_greater_than((ptree *)tree, key);                      \
+  }                                                                            \
+  static inline ptree_of_##type##_it *ptree_remove_by_it__##type(              \
+      ptree_of_##type *tree, ptree_of_##type##_it *it) {                       \
+    return (ptree_of_##type##_it *)ptree_remove_by_it((ptree *)tree,           \
+                                                      (ptree_it *)it);         \
+  }                                                                            \
+  DEFINE_TYPED_PTREE_MULTISET_OF(type)                                         \
+  static inline int ptree_get_multiset__##type(const ptree_of_##type *tree) {  \
+    return ptree_get_multiset((const ptree *)tree);                            \
+  }                                                                            \
+  static inline void ptree_set_capacity__##type(                               \
+      ptree_of_##type *tree, size_t capacity, int evict_max) {                 \
+    ptree_set_capacity((ptree *)tree, capacity, evict_max);                    \
+  }                                                                            \
+  static inline size_t ptree_get_capacity__##type(                             \
+      const ptree_of_##type *tree) {                                           \
+    return ptree_get_capacity((const ptree *)tree);                            \
+  }                                                                            \
+  static inline void ptree_set_finger_search__##type(ptree_of_##type *tree,    \
+                                                     int enabled) {            \
+    ptree_set_finger_search((ptree *)tree, enabled);                           \
+  }                                                                            \
+  static inline int ptree_get_finger_search__##type(                           \
+      const ptree_of_##type *tree) {                                           \
+    return ptree_get_finger_search((const ptree *)tree);                       \
+  }                                                                            \
+  static inline void ptree_set_lookup_cache__##type(                           \
+      ptree_of_##type *tree, ptree_hash_fptr hash_key, size_t num_entries) {   \
+    ptree_set_lookup_cache((ptree *)tree, hash_key, num_entries);              \
+  }                                                                            \
+  static inline void ptree_set_hash_index__##type(                             \
+      ptree_of_##type *tree, ptree_hash_fptr hash_elem,                        \
+      ptree_hash_fptr hash_key) {                                              \
+    ptree_set_hash_index((ptree *)tree, hash_elem, hash_key);                  \
+  }                                                                            \
+  static inline void ptree_set_bloom_filter__##type(                           \
+      ptree_of_##type *tree, ptree_hash_fptr hash_elem,                        \
+      ptree_hash_fptr hash_key) {                                              \
+    ptree_set_bloom_filter((ptree *)tree, hash_elem, hash_key);                \
   }                                                                            \
   static inline int32_t ptree_size__##type(const ptree_of_##type *tree) {      \
     return ptree_size((const ptree *)tree);                                    \
@@ -198,6 +688,22 @@ size_t ptree_get_max_nodes_to_auto_allocate(void);
   }                                                                            \
   static inline void ptree_shrink__##type(ptree_of_##type *tree) {             \
     ptree_shrink((ptree *)tree);                                               \
+  }                                                                            \
+  static inline ptree_merge *ptree_merge_new__##type(                          \
+      ptree_of_##type *const *trees, size_t n, int dedup) {                    \
+    return ptree_merge_new((ptree *const *)trees, n, dedup);                   \
+  }                                                                            \
+  static inline type *ptree_merge_next__##type(ptree_merge *merge) {           \
+    return (type *)ptree_merge_next(merge);                                    \
+  }                                                                            \
+  static inline ptree_learned *ptree_learned_new__##type(                      \
+      const ptree_of_##type *tree, ptree_int_key_fptr key_of,                  \
+      size_t max_error) {                                                      \
+    return ptree_learned_new((const ptree *)tree, key_of, max_error);          \
+  }                                                                            \
+  static inline type *ptree_learned_get__##type(const ptree_learned *index,    \
+                                                int64_t key) {                 \
+    return (type *)ptree_learned_get(index, key);                              \
   }
 
 #if defined(__cplusplus)
@@ -37,6 +37,7 @@ For more information, please refer to <http://unlicense.org/>
 #include <assert.h>
 #include <chrono>
 #include <iostream>
+#include <iterator>
 #include <random>
 #include <set>
 #include <stdlib.h>
@@ -76,6 +77,1823 @@ public:
   int next() { return uniform(rng); }
 };
 
+// the number of objects used by the tests of the single features
+#define NUM_FEATURE_OBJS 100000
+
+typedef set<simple_obj *, cmp_simple_obj_cpp> obj_set;
+typedef multiset<simple_obj *, cmp_simple_obj_cpp> obj_multiset;
+
+int cmp_key_simple_obj(const void *key, const void *obj) {
+  int lhs = *(const int *)key;
+  int rhs = ((const simple_obj *)obj)->key;
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+uint64_t hash_int(int key) { return (uint64_t)key * 0x9E3779B97F4A7C15ull; }
+
+uint64_t hash_key_simple_obj(const void *key) {
+  return hash_int(*(const int *)key);
+}
+
+uint64_t hash_simple_obj(const void *obj) {
+  return hash_int(((const simple_obj *)obj)->key);
+}
+
+int64_t key_of_simple_obj(const void *obj) {
+  return ((const simple_obj *)obj)->key;
+}
+
+// the objects visited by ptree_foreach, which stops after limit of them
+struct visit_log {
+  vector<simple_obj *> visited;
+  size_t limit;
+};
+
+int log_visit(void *obj, void *ctx) {
+  visit_log *log = (visit_log *)ctx;
+  log->visited.push_back((simple_obj *)obj);
+  return log->visited.size() >= log->limit;
+}
+
+// makes the objects for ptree_insert_or_get_by_key, taking them from a pool
+// large enough for all the calls, so that they are not moved
+struct obj_maker {
+  vector<simple_obj> pool;
+  size_t made;
+};
+
+void *make_simple_obj(const void *key, void *ctx) {
+  obj_maker *maker = (obj_maker *)ctx;
+  simple_obj *obj = &maker->pool[maker->made++];
+  obj->key = *(const int *)key;
+  return obj;
+}
+
+// counts the calls of the destructor of ptree_clear_with and ptree_free_with
+// for each of the objects, which are in an array starting at first
+struct destroy_log {
+  simple_obj *first;
+  vector<int> calls;
+};
+
+void log_destroy(void *obj, void *ctx) {
+  destroy_log *log = (destroy_log *)ctx;
+  ++log->calls[(simple_obj *)obj - log->first];
+}
+
+// keeps the objects whose key is not a multiple of *(int *)divisor
+int not_multiple_simple_obj(const void *obj, void *divisor) {
+  return ((const simple_obj *)obj)->key % *(int *)divisor != 0;
+}
+
+void set_key_simple_obj(void *obj, void *key) {
+  ((simple_obj *)obj)->key = *(int *)key;
+}
+
+simple_obj probe(int key) {
+  simple_obj obj;
+  obj.key = key;
+  return obj;
+}
+
+vector<simple_obj> make_objs(int num, random_int_generator &rng) {
+  vector<simple_obj> objs(num);
+  for (int i = 0; i < num; ++i) {
+    objs[i].key = rng.next();
+  }
+  return objs;
+}
+
+ptree_of_simple_obj *new_tree() {
+  return ptree_new__simple_obj(cmp_simple_obj, cmp_key_simple_obj, 0);
+}
+
+// checks, without printing anything unless they differ, that the tree holds
+// the same objects as the set, in the same order, and that its cached minimum
+// and maximum are right
+template <class set_type>
+bool same_content(ptree_of_simple_obj *t, const set_type &s) {
+  if ((size_t)ptree_size__simple_obj(t) != s.size()) {
+    cout << "size error: std::set " << s.size() << ", ptree "
+         << ptree_size__simple_obj(t) << endl;
+    return false;
+  }
+  ptree_cursor cursor;
+  ptree_of_simple_obj_it *it = ptree_cursor_min__simple_obj(t, &cursor);
+  size_t i = 0;
+  for (auto *x : s) {
+    if (!it || it->ptr != x) {
+      cout << "order error at " << i << ": " << x->key << " "
+           << (it ? it->ptr->key : -1) << endl;
+      return false;
+    }
+    it = ptree_cursor_next__simple_obj(&cursor);
+    ++i;
+  }
+  ptree_of_simple_obj_it *min = ptree_min__simple_obj(t);
+  ptree_of_simple_obj_it *max = ptree_max__simple_obj(t);
+  bool min_max_ok = s.empty() ? !min && !max
+                              : min && min->ptr == *s.begin() && max &&
+                                    max->ptr == *s.rbegin();
+  if (!min_max_ok) {
+    cout << "min/max error" << endl;
+    return false;
+  }
+  return true;
+}
+
+// the element after it, found with ptree_equal_range where ptree_it_next is
+// not available
+ptree_of_simple_obj_it *next_of(ptree_of_simple_obj *t,
+                                ptree_of_simple_obj_it *it) {
+#if (PTREE_NO_PARENT_POINTERS == 0 || PTREE_THREADED == 1)
+  (void)t;
+  return ptree_it_next__simple_obj(it);
+#else
+  ptree_of_simple_obj_it *begin;
+  ptree_of_simple_obj_it *end;
+  ptree_equal_range__simple_obj(t, &it->ptr->key, &begin, &end);
+  return end;
+#endif
+}
+
+// prints the sizes of the tree and of the set, and checks that they hold the
+// same objects in the same order
+template <class set_type>
+bool check_same(ptree_of_simple_obj *t, const set_type &s) {
+  cout << "size... " << endl;
+  cout << "std::set " << s.size() << endl;
+  cout << "ptree " << ptree_size__simple_obj(t) << endl;
+  cout << ((s.size() == (size_t)ptree_size__simple_obj(t)) ? "...is the same"
+                                                           : "NOT the same!")
+       << endl;
+  cout << "checking element by element (order)..." << endl;
+  return same_content(t, s);
+}
+
+bool report(const char *what, bool ok) {
+  cout << (ok ? "...ok: " : "...FAILED: ") << what << endl;
+  return ok;
+}
+
+// whether the insertion into a set or a multiset that returned x inserted the
+// object, which a multiset always does
+bool inserted(const pair<obj_set::iterator, bool> &x) { return x.second; }
+bool inserted(const obj_multiset::iterator &) { return true; }
+
+// a tree, an empty set, and NUM_FEATURE_OBJS objects with random keys up to
+// max_key, from which most tests of the single features start
+template <class set_type = obj_set> struct feature_test {
+  random_int_generator rng;
+  vector<simple_obj> objs;
+  ptree_of_simple_obj *t;
+  set_type s;
+
+  feature_test(int max_key = NUM_FEATURE_OBJS)
+      : rng(max_key), objs(make_objs(NUM_FEATURE_OBJS, rng)), t(new_tree()) {}
+
+  ~feature_test() { ptree_free__simple_obj(t); }
+
+  // inserts all the objects in the tree and in the set
+  void fill() {
+    for (auto &obj : objs) {
+      s.insert(&obj);
+      ptree_insert__simple_obj(t, &obj);
+    }
+  }
+};
+
+// shrinks the tree after removals and after emptying it, and checks that it
+// can still be used and freed
+bool test_shrink() {
+  feature_test<> test;
+  test.fill();
+  ptree_of_simple_obj *t = test.t;
+  obj_set &s = test.s;
+  for (size_t i = 0; i < test.objs.size(); i += 2) {
+    s.erase(&test.objs[i]);
+    ptree_remove__simple_obj(t, &test.objs[i]);
+  }
+  ptree_shrink__simple_obj(t);
+  bool ok = same_content(t, s);
+  // the nodes freed by ptree_shrink are allocated again
+  test.fill();
+  ok = ok && same_content(t, s);
+  ptree_empty__simple_obj(t);
+  s.clear();
+  ptree_shrink__simple_obj(t);
+  ok = ok && same_content(t, s);
+  test.fill();
+  ok = ok && same_content(t, s);
+  return report("ptree_shrink", ok);
+}
+
+// runs steps random insertions, removals and lookups on the tree and on the set
+// of the test, checking that they agree. Every other key is close to the
+// previous one, as finger search and the lookup cache pay off on local
+// accesses.
+bool churn(feature_test<> &test, int steps) {
+  ptree_of_simple_obj *t = test.t;
+  obj_set &s = test.s;
+  bool ok = true;
+  int key = 0;
+  for (int i = 0; i < steps && ok; ++i) {
+    key = i % 2 ? test.rng.next() : key + test.rng.next() % 16 - 8;
+    simple_obj key_probe = probe(key);
+    auto x = s.find(&key_probe);
+    simple_obj *obj = &test.objs[test.rng.next() % NUM_FEATURE_OBJS];
+    switch (test.rng.next() % 5) {
+    case 0:
+      ok = ptree_insert__simple_obj(t, obj) == (int)s.insert(obj).second;
+      break;
+    case 1:
+      ok = ptree_remove__simple_obj(t, obj) == (int)s.erase(obj);
+      break;
+    case 2:
+      ok = ptree_remove_by_key__simple_obj(t, &key) ==
+           (int)s.erase(&key_probe);
+      break;
+    case 3:
+      ok = (ptree_has__simple_obj(t, &key_probe) != NULL) == (x != s.end());
+      break;
+    default: {
+      ptree_of_simple_obj_it *it = ptree_get_it__simple_obj(t, &key);
+      ok = x == s.end() ? !it : it && it->ptr == *x;
+      break;
+    }
+    }
+  }
+  return ok && same_content(t, s);
+}
+
+// looks up batches of random keys, some of them not in the tree, and checks
+// the results against ptree_get. The sizes of the batches are not all
+// multiples of the number of lookups that ptree_get_many interleaves.
+bool test_get_many() {
+  feature_test<> test;
+  test.fill();
+  bool ok = true;
+  size_t sizes[] = {0, 1, 15, 16, 17, 1000, 4099};
+  for (size_t n : sizes) {
+    vector<int> keys(n);
+    vector<const void *> key_ptrs(n);
+    for (size_t i = 0; i < n; ++i) {
+      // a few keys are out of the range of the tree
+      keys[i] = test.rng.next() - (i % 7 == 0 ? NUM_FEATURE_OBJS / 64 : 0);
+      key_ptrs[i] = &keys[i];
+    }
+    vector<simple_obj *> out(n, &test.objs[0]);
+    ptree_get_many__simple_obj(test.t, key_ptrs.data(), n, out.data());
+    for (size_t i = 0; i < n && ok; ++i) {
+      ok = out[i] == ptree_get__simple_obj(test.t, &keys[i]);
+    }
+  }
+  // an empty tree, and a tree with a single object
+  ptree_of_simple_obj *small = new_tree();
+  int small_keys[] = {test.objs[0].key, test.objs[0].key + 1};
+  const void *small_key_ptrs[] = {&small_keys[0], &small_keys[1]};
+  simple_obj *small_out[] = {&test.objs[1], &test.objs[1]};
+  ptree_get_many__simple_obj(small, small_key_ptrs, 2, small_out);
+  ok = ok && !small_out[0] && !small_out[1];
+  ptree_insert__simple_obj(small, &test.objs[0]);
+  ptree_get_many__simple_obj(small, small_key_ptrs, 2, small_out);
+  ok = ok && small_out[0] == &test.objs[0] && !small_out[1];
+  ptree_free__simple_obj(small);
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  // in a multiset, each key finds one of the objects with the key
+  feature_test<obj_multiset> multi(NUM_FEATURE_OBJS / 16);
+  ptree_set_multiset__simple_obj(multi.t, 1);
+  multi.fill();
+  vector<int> keys(1000);
+  vector<const void *> key_ptrs(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    keys[i] = multi.rng.next();
+    key_ptrs[i] = &keys[i];
+  }
+  vector<simple_obj *> out(keys.size());
+  ptree_get_many__simple_obj(multi.t, key_ptrs.data(), keys.size(),
+                             out.data());
+  for (size_t i = 0; i < keys.size() && ok; ++i) {
+    simple_obj key_probe = probe(keys[i]);
+    ok = multi.s.count(&key_probe) ? out[i] && out[i]->key == keys[i]
+                                   : !out[i];
+  }
+#endif
+  return report("ptree_get_many", ok);
+}
+
+// looks up sorted batches of keys, with repeated keys, runs of consecutive
+// keys, and keys out of the range of the tree, and checks the results against
+// ptree_get
+bool test_get_many_sorted() {
+  feature_test<> test;
+  test.fill();
+  bool ok = true;
+  for (int round = 0; round < 100 && ok; ++round) {
+    size_t n = test.rng.next() % 2000;
+    vector<int> keys(n);
+    for (size_t i = 0; i < n; ++i) {
+      switch (round % 4) {
+      case 0:
+        keys[i] = test.rng.next();
+        break;
+      case 1:
+        // few distinct keys, so most of them are repeated
+        keys[i] = test.rng.next() % 64 * (NUM_FEATURE_OBJS / 64);
+        break;
+      case 2:
+        keys[i] = (int)i + test.rng.next() % 4 - 2;
+        break;
+      default:
+        keys[i] = NUM_FEATURE_OBJS - (int)i + 2;
+        break;
+      }
+    }
+    sort(keys.begin(), keys.end());
+    vector<const void *> key_ptrs(n);
+    for (size_t i = 0; i < n; ++i) {
+      key_ptrs[i] = &keys[i];
+    }
+    vector<simple_obj *> out(n, &test.objs[0]);
+    ptree_get_many_sorted__simple_obj(test.t, key_ptrs.data(), n, out.data());
+    for (size_t i = 0; i < n && ok; ++i) {
+      ok = out[i] == ptree_get__simple_obj(test.t, &keys[i]);
+    }
+  }
+  // an empty tree, and a tree with a single object, with the key of the
+  // object repeated and between keys out of the tree
+  ptree_of_simple_obj *small = new_tree();
+  int key = test.objs[0].key;
+  int small_keys[] = {key - 1, key, key, key + 1};
+  const void *small_key_ptrs[] = {&small_keys[0], &small_keys[1],
+                                  &small_keys[2], &small_keys[3]};
+  simple_obj *small_out[4];
+  ptree_get_many_sorted__simple_obj(small, small_key_ptrs, 4, small_out);
+  ok = ok && !small_out[0] && !small_out[1] && !small_out[2] && !small_out[3];
+  ptree_insert__simple_obj(small, &test.objs[0]);
+  ptree_get_many_sorted__simple_obj(small, small_key_ptrs, 4, small_out);
+  ok = ok && !small_out[0] && small_out[1] == &test.objs[0] &&
+       small_out[2] == &test.objs[0] && !small_out[3];
+  ptree_free__simple_obj(small);
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  // in a multiset, each key finds one of the objects with the key
+  feature_test<obj_multiset> multi(NUM_FEATURE_OBJS / 16);
+  ptree_set_multiset__simple_obj(multi.t, 1);
+  multi.fill();
+  vector<int> keys(1000);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    keys[i] = multi.rng.next();
+  }
+  sort(keys.begin(), keys.end());
+  vector<const void *> key_ptrs(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    key_ptrs[i] = &keys[i];
+  }
+  vector<simple_obj *> out(keys.size());
+  ptree_get_many_sorted__simple_obj(multi.t, key_ptrs.data(), keys.size(),
+                                    out.data());
+  for (size_t i = 0; i < keys.size() && ok; ++i) {
+    simple_obj key_probe = probe(keys[i]);
+    ok = multi.s.count(&key_probe) ? out[i] && out[i]->key == keys[i]
+                                   : !out[i];
+  }
+#endif
+  return report("ptree_get_many_sorted", ok);
+}
+
+// inserts the objects of the test in the tree with ptree_insert_hint, and in
+// the set, checking the returned iterators: the first ones at the end with a
+// NULL hint, then others before the minimum, each with the last returned
+// iterator as hint, then objects equal to them with right and wrong hints
+template <class set_type> bool check_insert_hint(feature_test<set_type> &test) {
+  ptree_of_simple_obj *t = test.t;
+  set_type &s = test.s;
+  bool multiset = ptree_get_multiset__simple_obj(t);
+  vector<simple_obj *> sorted;
+  for (auto &obj : test.objs) {
+    sorted.push_back(&obj);
+  }
+  stable_sort(sorted.begin(), sorted.end(), cmp_simple_obj_cpp());
+  // inserts obj in both, and returns the iterator returned by the tree if it
+  // points to the object that has to be in the tree, else NULL
+  auto insert = [&](simple_obj *obj, ptree_of_simple_obj_it *hint) {
+    auto x = s.find(obj);
+    simple_obj *expected = !multiset && x != s.end() ? *x : obj;
+    if (expected == obj) {
+      s.insert(obj);
+    }
+    ptree_of_simple_obj_it *it = ptree_insert_hint__simple_obj(t, hint, obj);
+    return it && it->ptr == expected ? it : NULL;
+  };
+  bool ok = true;
+  size_t half = sorted.size() / 2;
+  for (size_t i = half; i < sorted.size() && ok; ++i) {
+    ok = insert(sorted[i], NULL) != NULL;
+  }
+  ptree_of_simple_obj_it *hint = ptree_min__simple_obj(t);
+  for (size_t i = half; i > 0 && ok; --i) {
+    hint = insert(sorted[i - 1], hint);
+    ok = hint != NULL;
+  }
+  ok = ok && same_content(t, s);
+  // even iterations hint the first element greater than the object, which is
+  // right, odd ones a random element, or NULL
+  vector<simple_obj> more = make_objs(NUM_FEATURE_OBJS / 10, test.rng);
+  for (size_t i = 0; i < more.size() && ok; ++i) {
+    int key = i % 2 ? test.rng.next() : more[i].key;
+    ptree_of_simple_obj_it *begin;
+    ptree_of_simple_obj_it *end;
+    ptree_equal_range__simple_obj(t, &key, &begin, &end);
+    ok = insert(&more[i], i % 2 ? begin : end) != NULL;
+  }
+  // objects with the key of an element of the tree, hinting that element or
+  // the next one
+  vector<simple_obj> twins(1000);
+  for (size_t i = 0; i < twins.size() && ok; ++i) {
+    twins[i].key = test.objs[test.rng.next() % NUM_FEATURE_OBJS].key;
+    ptree_of_simple_obj_it *it = ptree_get_it__simple_obj(t, &twins[i].key);
+    ok = it && insert(&twins[i], i % 2 ? it : next_of(t, it)) != NULL;
+  }
+  return ok && same_content(t, s);
+}
+
+bool test_insert_hint() {
+  feature_test<> test;
+  bool ok = check_insert_hint(test);
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  feature_test<obj_multiset> multiset_test(NUM_FEATURE_OBJS / 16);
+  ptree_set_multiset__simple_obj(multiset_test.t, 1);
+  ok = check_insert_hint(multiset_test) && ok;
+#endif
+  // the first object of an empty tree, then objects before and after it, and
+  // one equal to it, which is not inserted
+  ptree_of_simple_obj *small = new_tree();
+  simple_obj objs[] = {probe(1), probe(0), probe(2), probe(1)};
+  ptree_of_simple_obj_it *first =
+      ptree_insert_hint__simple_obj(small, NULL, &objs[0]);
+  ok = ok && first && first->ptr == &objs[0];
+  ptree_of_simple_obj_it *before =
+      ptree_insert_hint__simple_obj(small, first, &objs[1]);
+  ptree_of_simple_obj_it *after =
+      ptree_insert_hint__simple_obj(small, NULL, &objs[2]);
+  ptree_of_simple_obj_it *equal =
+      ptree_insert_hint__simple_obj(small, after, &objs[3]);
+  obj_set s = {&objs[0], &objs[1], &objs[2]};
+  ok = ok && before && before->ptr == &objs[1] && after &&
+       after->ptr == &objs[2] && equal == first && same_content(small, s);
+  ptree_free__simple_obj(small);
+  return report("ptree_insert_hint", ok);
+}
+
+// checks the lookups and the removals on a tree set up by configure when it is
+// empty, when it holds a single object, and, with parent pointers, when it is
+// a multiset holding objects with the same key
+bool check_small_trees(void (*configure)(ptree_of_simple_obj *t)) {
+  simple_obj objs[] = {probe(7), probe(7), probe(7)};
+  int key = 7;
+  int other_key = 8;
+  ptree_of_simple_obj *t = new_tree();
+  configure(t);
+  bool ok = !ptree_get__simple_obj(t, &key) &&
+            !ptree_has__simple_obj(t, &objs[0]) &&
+            !ptree_remove__simple_obj(t, &objs[0]) &&
+            !ptree_remove_by_key__simple_obj(t, &key);
+  ok = ok && ptree_insert__simple_obj(t, &objs[0]) &&
+       ptree_get__simple_obj(t, &key) == &objs[0] &&
+       !ptree_get__simple_obj(t, &other_key) &&
+       ptree_has__simple_obj(t, &objs[0]) &&
+       ptree_remove_by_key__simple_obj(t, &key) &&
+       !ptree_get__simple_obj(t, &key) && !ptree_has__simple_obj(t, &objs[0]);
+  ok = ok && ptree_insert__simple_obj(t, &objs[0]) &&
+       ptree_remove__simple_obj(t, &objs[0]) &&
+       !ptree_get__simple_obj(t, &key) && same_content(t, obj_set());
+  ptree_free__simple_obj(t);
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  t = new_tree();
+  configure(t);
+  ptree_set_multiset__simple_obj(t, 1);
+  obj_multiset s;
+  for (auto &obj : objs) {
+    ptree_insert__simple_obj(t, &obj);
+    s.insert(&obj);
+  }
+  ok = ok && same_content(t, s) && ptree_remove__simple_obj(t, &objs[1]) &&
+       !ptree_has__simple_obj(t, &objs[1]) &&
+       ptree_has__simple_obj(t, &objs[0]) &&
+       ptree_has__simple_obj(t, &objs[2]);
+  simple_obj *found = ptree_get__simple_obj(t, &key);
+  ok = ok && (found == &objs[0] || found == &objs[2]) &&
+       ptree_remove_by_key__simple_obj(t, &key) &&
+       ptree_remove_by_key__simple_obj(t, &key) &&
+       !ptree_remove_by_key__simple_obj(t, &key) &&
+       !ptree_get__simple_obj(t, &key) && same_content(t, obj_multiset());
+  ptree_free__simple_obj(t);
+#endif
+  return ok;
+}
+
+bool test_finger_search() {
+  feature_test<> test;
+  ptree_set_finger_search__simple_obj(test.t, 1);
+  test.fill();
+  bool ok = churn(test, 10 * NUM_FEATURE_OBJS);
+  ok = ok && check_small_trees([](ptree_of_simple_obj *t) {
+         ptree_set_finger_search__simple_obj(t, 1);
+       });
+  return report("finger search", ok);
+}
+
+bool test_lookup_cache() {
+  feature_test<> test;
+  ptree_set_lookup_cache__simple_obj(test.t, hash_key_simple_obj, 256);
+  test.fill();
+  bool ok = churn(test, 10 * NUM_FEATURE_OBJS);
+  ok = ok && check_small_trees([](ptree_of_simple_obj *t) {
+         ptree_set_lookup_cache__simple_obj(t, hash_key_simple_obj, 256);
+       });
+  return report("lookup cache", ok);
+}
+
+bool test_hash_index() {
+  feature_test<> test;
+  ptree_set_hash_index__simple_obj(test.t, hash_simple_obj,
+                                   hash_key_simple_obj);
+  test.fill();
+  bool ok = churn(test, 10 * NUM_FEATURE_OBJS);
+  ok = ok && check_small_trees([](ptree_of_simple_obj *t) {
+         ptree_set_hash_index__simple_obj(t, hash_simple_obj,
+                                          hash_key_simple_obj);
+       });
+  return report("hash index", ok);
+}
+
+bool test_bloom_filter() {
+  feature_test<> test;
+  ptree_set_bloom_filter__simple_obj(test.t, hash_simple_obj,
+                                     hash_key_simple_obj);
+  test.fill();
+  bool ok = churn(test, 10 * NUM_FEATURE_OBJS);
+  ok = ok && check_small_trees([](ptree_of_simple_obj *t) {
+         ptree_set_bloom_filter__simple_obj(t, hash_simple_obj,
+                                            hash_key_simple_obj);
+       });
+  return report("bloom filter", ok);
+}
+
+// builds learned indexes with different errors of an empty tree, of a tree
+// with uniform keys and of one with skewed keys, and checks all their lookups
+// against ptree_get
+bool test_learned_index() {
+  feature_test<> tests[2];
+  // the keys of the second tree get denser toward 0
+  for (auto &obj : tests[1].objs) {
+    obj.key = (int)((int64_t)obj.key * obj.key / NUM_FEATURE_OBJS);
+  }
+  bool ok = true;
+  size_t errors[] = {0, 1, 16, 256};
+  for (auto &test : tests) {
+    for (int filled = 0; filled < 2; ++filled) {
+      if (filled) {
+        test.fill();
+      }
+      for (size_t error : errors) {
+        ptree_learned *index =
+            ptree_learned_new__simple_obj(test.t, key_of_simple_obj, error);
+        for (int key = -1; key <= NUM_FEATURE_OBJS + 1 && ok; ++key) {
+          ok = ptree_learned_get__simple_obj(index, key) ==
+               ptree_get__simple_obj(test.t, &key);
+        }
+        ptree_learned_free(index);
+      }
+    }
+  }
+  // a single object, then objects far from it on both sides. The keys are
+  // within the range in which cmp_simple_obj does not overflow.
+  ptree_of_simple_obj *small = new_tree();
+  simple_obj objs[] = {probe(0), probe(-1000000000), probe(1000000000)};
+  int keys[] = {-1000000001, -1000000000, -999999999, -1, 0, 1,
+                999999999,   1000000000,  1000000001};
+  for (auto &obj : objs) {
+    ptree_insert__simple_obj(small, &obj);
+    for (size_t error : errors) {
+      ptree_learned *index =
+          ptree_learned_new__simple_obj(small, key_of_simple_obj, error);
+      for (int key : keys) {
+        ok = ok && ptree_learned_get__simple_obj(index, key) ==
+                       ptree_get__simple_obj(small, &key);
+      }
+      ptree_learned_free(index);
+    }
+  }
+  ptree_free__simple_obj(small);
+  return report("learned index", ok);
+}
+
+#if (PTREE_NO_PARENT_POINTERS == 0 || PTREE_THREADED == 1)
+
+// walks the tree forward with ptree_it_next and backward with ptree_it_prev,
+// checking the elements against the set
+template <class set_type>
+bool check_it_steps(ptree_of_simple_obj *t, const set_type &s) {
+  ptree_of_simple_obj_it *it = ptree_min__simple_obj(t);
+  for (auto x = s.begin(); x != s.end(); ++x) {
+    if (!it || it->ptr != *x) {
+      return false;
+    }
+    it = ptree_it_next__simple_obj(it);
+  }
+  if (it) {
+    return false;
+  }
+  it = ptree_max__simple_obj(t);
+  for (auto x = s.rbegin(); x != s.rend(); ++x) {
+    if (!it || it->ptr != *x) {
+      return false;
+    }
+    it = ptree_it_prev__simple_obj(it);
+  }
+  return !it;
+}
+
+// steps through an empty tree, a single element tree, a tree after insertions
+// and removals, which have to keep the threads of PTREE_THREADED up to date,
+// and a multiset with equal elements
+bool test_it_steps() {
+  feature_test<> test;
+  bool ok = check_it_steps(test.t, test.s);
+  test.s.insert(&test.objs[0]);
+  ptree_insert__simple_obj(test.t, &test.objs[0]);
+  ok = ok && check_it_steps(test.t, test.s);
+  test.fill();
+  ok = ok && churn(test, NUM_FEATURE_OBJS) && check_it_steps(test.t, test.s);
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  feature_test<obj_multiset> multiset_test(NUM_FEATURE_OBJS / 16);
+  ptree_set_multiset__simple_obj(multiset_test.t, 1);
+  multiset_test.fill();
+  ok = ok && check_it_steps(multiset_test.t, multiset_test.s);
+#endif
+  return report("ptree_it_next and ptree_it_prev", ok);
+}
+
+#endif
+
+// shuffles v with rng
+template <class T> void shuffle_with(vector<T> &v, random_int_generator &rng) {
+  for (size_t i = v.size(); i > 1; --i) {
+    swap(v[i - 1], v[rng.next() % i]);
+  }
+}
+
+// empties trees of up to 64 objects, inserted and removed in random orders,
+// with ptree_remove, ptree_remove_by_key and ptree_remove_by_it in turn,
+// checking the tree after each removal. Small trees go through all the cases
+// of the rebalancing, also when the removed element is the root or the minimum
+// or the maximum.
+bool test_small_removals() {
+  random_int_generator rng(1 << 20);
+  bool ok = true;
+  for (int n = 0; n <= 64 && ok; ++n) {
+    for (int round = 0; round < 16 && ok; ++round) {
+      vector<simple_obj> objs(n);
+      vector<simple_obj *> order(n);
+      for (int i = 0; i < n; ++i) {
+        objs[i].key = i;
+        order[i] = &objs[i];
+      }
+      ptree_of_simple_obj *t = new_tree();
+      obj_set s;
+      shuffle_with(order, rng);
+      for (auto *obj : order) {
+        ptree_insert__simple_obj(t, obj);
+        s.insert(obj);
+      }
+      shuffle_with(order, rng);
+      for (int i = 0; i < n && ok; ++i) {
+        simple_obj *obj = order[i];
+        auto next = s.upper_bound(obj);
+        s.erase(obj);
+        switch (i % 3) {
+        case 0:
+          ok = ptree_remove__simple_obj(t, obj) &&
+               !ptree_remove__simple_obj(t, obj);
+          break;
+        case 1:
+          ok = ptree_remove_by_key__simple_obj(t, &obj->key) &&
+               !ptree_remove_by_key__simple_obj(t, &obj->key);
+          break;
+        default: {
+          ptree_of_simple_obj_it *it = ptree_get_it__simple_obj(t, &obj->key);
+          it = it ? ptree_remove_by_it__simple_obj(t, it) : NULL;
+          ok = next == s.end() ? !it : it && it->ptr == *next;
+          break;
+        }
+        }
+        ok = ok && same_content(t, s);
+      }
+      ptree_free__simple_obj(t);
+    }
+  }
+  return report("removals from small trees", ok);
+}
+
+// checks full and early stopped traversals with ptree_foreach and
+// ptree_foreach_range against the set. Half of the ranges start at the key of
+// an element, which in a multiset can have equal elements on its left.
+template <class set_type> bool check_foreach(feature_test<set_type> &test) {
+  ptree_of_simple_obj *t = test.t;
+  set_type &s = test.s;
+  visit_log log;
+  log.limit = SIZE_MAX;
+  bool ok = ptree_foreach__simple_obj(t, log_visit, &log) == 0 &&
+            equal(s.begin(), s.end(), log.visited.begin(), log.visited.end());
+  for (int i = 0; i < 1000 && ok; ++i) {
+    log.visited.clear();
+    log.limit = test.rng.next() % (s.size() + 2) + 1;
+    size_t expected_num = min(log.limit, s.size());
+    ok = ptree_foreach__simple_obj(t, log_visit, &log) ==
+             (log.limit <= s.size()) &&
+         equal(s.begin(), next(s.begin(), expected_num), log.visited.begin(),
+               log.visited.end());
+  }
+  for (int i = 0; i < 4000 && ok; ++i) {
+    int min_key = i % 2 ? test.objs[test.rng.next() % NUM_FEATURE_OBJS].key
+                        : test.rng.next();
+    // every fourth range is a single key
+    int max_key = i % 4 == 3 ? min_key : min_key + test.rng.next() % 1000;
+    simple_obj min_probe = probe(min_key);
+    simple_obj max_probe = probe(max_key);
+    auto first = s.lower_bound(&min_probe);
+    auto last = s.upper_bound(&max_probe);
+    const int *min_ptr = &min_key;
+    const int *max_ptr = &max_key;
+    if (i % 8 == 0) {
+      min_ptr = NULL;
+      first = s.begin();
+    } else if (i % 8 == 2) {
+      max_ptr = NULL;
+      last = s.end();
+    } else if (i % 64 == 4) {
+      min_ptr = max_ptr = NULL;
+      first = s.begin();
+      last = s.end();
+    }
+    size_t range_num = distance(first, last);
+    log.visited.clear();
+    // some traversals stop before the end of the range
+    log.limit = i % 3 ? SIZE_MAX : test.rng.next() % (range_num + 1) + 1;
+    if (log.limit < range_num) {
+      last = next(first, log.limit);
+    }
+    ok = ptree_foreach_range__simple_obj(t, min_ptr, max_ptr, log_visit,
+                                         &log) == (log.limit <= range_num) &&
+         equal(first, last, log.visited.begin(), log.visited.end());
+  }
+  // a range whose maximum is less than its minimum is empty
+  if (!s.empty() && ok) {
+    int min_key = (*s.begin())->key;
+    int max_key = min_key - 1;
+    log.visited.clear();
+    log.limit = SIZE_MAX;
+    ok = ptree_foreach_range__simple_obj(t, &min_key, &max_key, log_visit,
+                                         &log) == 0 &&
+         log.visited.empty();
+  }
+  return ok;
+}
+
+bool test_foreach() {
+  bool ok = true;
+  // an empty tree, a single element tree and a full one
+  for (int filled = 0; filled < 3; ++filled) {
+    feature_test<> test;
+    if (filled == 1) {
+      test.s.insert(&test.objs[0]);
+      ptree_insert__simple_obj(test.t, &test.objs[0]);
+    } else if (filled == 2) {
+      test.fill();
+    }
+    ok = check_foreach(test) && ok;
+  }
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  feature_test<obj_multiset> multiset_test(NUM_FEATURE_OBJS / 16);
+  ptree_set_multiset__simple_obj(multiset_test.t, 1);
+  multiset_test.fill();
+  ok = check_foreach(multiset_test) && ok;
+#endif
+  return report("ptree_foreach and ptree_foreach_range", ok);
+}
+
+// exports the tree in chunks whose sizes do not divide its size, and checks
+// them against ptree_export_all and the order of the set
+bool test_export() {
+  feature_test<> test;
+  test.fill();
+  vector<simple_obj *> expected(test.s.begin(), test.s.end());
+  vector<simple_obj *> all(expected.size() + 1);
+  bool ok = ptree_export_all__simple_obj(test.t, all.data()) ==
+                expected.size() &&
+            equal(expected.begin(), expected.end(), all.begin());
+  size_t chunk_sizes[] = {7, 1000, expected.size() + 1};
+  for (size_t chunk_size : chunk_sizes) {
+    while (expected.size() % chunk_size == 0) {
+      ++chunk_size;
+    }
+    vector<simple_obj *> chunks;
+    vector<simple_obj *> chunk(chunk_size);
+    ptree_cursor cursor;
+    ptree_cursor_min__simple_obj(test.t, &cursor);
+    size_t count;
+    do {
+      count = ptree_export__simple_obj(&cursor, chunk.data(), chunk_size);
+      chunks.insert(chunks.end(), chunk.begin(), chunk.begin() + count);
+    } while (count == chunk_size);
+    ok = ok && chunks == expected;
+  }
+  ptree_of_simple_obj *empty = new_tree();
+  ptree_cursor cursor;
+  ok = ok && ptree_export_all__simple_obj(empty, all.data()) == 0 &&
+       !ptree_cursor_min__simple_obj(empty, &cursor) &&
+       ptree_export__simple_obj(&cursor, all.data(), all.size()) == 0;
+  // a single element, exported after an empty chunk, which does not move the
+  // cursor
+  ptree_insert__simple_obj(empty, &test.objs[0]);
+  ok = ok && ptree_export_all__simple_obj(empty, all.data()) == 1 &&
+       all[0] == &test.objs[0] &&
+       ptree_cursor_min__simple_obj(empty, &cursor) &&
+       ptree_export__simple_obj(&cursor, all.data(), 0) == 0 &&
+       ptree_export__simple_obj(&cursor, all.data(), all.size()) == 1 &&
+       all[0] == &test.objs[0] &&
+       ptree_export__simple_obj(&cursor, all.data(), all.size()) == 0;
+  ptree_free__simple_obj(empty);
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  // equal elements are exported in the order of the multiset
+  feature_test<obj_multiset> multiset_test(NUM_FEATURE_OBJS / 16);
+  ptree_set_multiset__simple_obj(multiset_test.t, 1);
+  multiset_test.fill();
+  vector<simple_obj *> all_equal(multiset_test.s.size());
+  ok = ok &&
+       ptree_export_all__simple_obj(multiset_test.t, all_equal.data()) ==
+           all_equal.size() &&
+       equal(multiset_test.s.begin(), multiset_test.s.end(), all_equal.begin());
+#endif
+  return report("ptree_export and ptree_export_all", ok);
+}
+
+bool test_remove_by_it() {
+  feature_test<> test;
+  test.fill();
+  ptree_of_simple_obj *t = test.t;
+  obj_set &s = test.s;
+  // removes the objects with odd keys, checking each returned iterator
+  bool ok = true;
+  ptree_of_simple_obj_it *it = ptree_min__simple_obj(t);
+  auto expected = s.begin();
+  while (it && ok) {
+    ok = expected != s.end() && it->ptr == *expected;
+    if (it->ptr->key % 2) {
+      it = ptree_remove_by_it__simple_obj(t, it);
+      expected = s.erase(expected);
+    } else {
+      it = next_of(t, it);
+      ++expected;
+    }
+  }
+  ok = ok && expected == s.end() && same_content(t, s);
+  // removes the rest from the minimum
+  it = ptree_min__simple_obj(t);
+  while (it) {
+    it = ptree_remove_by_it__simple_obj(t, it);
+    s.erase(s.begin());
+    ok = ok && (s.empty() ? !it : it && it->ptr == *s.begin());
+  }
+  ok = ok && same_content(t, s);
+  // the last element of a single element tree has no next one
+  ptree_insert__simple_obj(t, &test.objs[0]);
+  ok = ok && !ptree_remove_by_it__simple_obj(t, ptree_min__simple_obj(t)) &&
+       same_content(t, s);
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  // in a multiset, removes every other element, so the next one is often equal
+  // to the removed one
+  feature_test<obj_multiset> multiset_test(NUM_FEATURE_OBJS / 16);
+  ptree_set_multiset__simple_obj(multiset_test.t, 1);
+  multiset_test.fill();
+  it = ptree_min__simple_obj(multiset_test.t);
+  auto expected_equal = multiset_test.s.begin();
+  for (bool remove = true; it && ok; remove = !remove) {
+    ok = expected_equal != multiset_test.s.end() && it->ptr == *expected_equal;
+    if (remove) {
+      it = ptree_remove_by_it__simple_obj(multiset_test.t, it);
+      expected_equal = multiset_test.s.erase(expected_equal);
+    } else {
+      it = ptree_it_next__simple_obj(it);
+      ++expected_equal;
+    }
+  }
+  ok = ok && expected_equal == multiset_test.s.end() &&
+       same_content(multiset_test.t, multiset_test.s);
+#endif
+  return report("removal through iterators while iterating", ok);
+}
+
+// inserts objects with ptree_insert_or_get, and makes objects for random keys
+// with ptree_insert_or_get_by_key, checking that only absent keys are inserted
+// or made, and that out points to the element with the key. Even a multiset
+// does not insert a key it already has.
+template <class set_type>
+bool check_insert_or_get(feature_test<set_type> &test) {
+  ptree_of_simple_obj *t = test.t;
+  set_type &s = test.s;
+  vector<simple_obj> objs = make_objs(NUM_FEATURE_OBJS, test.rng);
+  obj_maker maker;
+  maker.pool.resize(NUM_FEATURE_OBJS);
+  maker.made = 0;
+  bool ok = true;
+  for (int i = 0; i < NUM_FEATURE_OBJS && ok; ++i) {
+    simple_obj *obj = &objs[i];
+    auto x = s.find(obj);
+    bool absent = x == s.end();
+    ptree_of_simple_obj_it *out = NULL;
+    // every fourth call does not ask for the iterator
+    ptree_of_simple_obj_it **out_ptr = i % 4 == 3 ? NULL : &out;
+    simple_obj *expected;
+    if (i % 2) {
+      expected = absent ? obj : *x;
+      ok = ptree_insert_or_get__simple_obj(t, obj, out_ptr) == absent;
+    } else {
+      size_t made = maker.made;
+      expected = absent ? &maker.pool[made] : *x;
+      ok = ptree_insert_or_get_by_key__simple_obj(t, &obj->key,
+                                                  make_simple_obj, &maker,
+                                                  out_ptr) == absent &&
+           maker.made == made + absent;
+    }
+    if (absent) {
+      s.insert(expected);
+    }
+    // in a multiset, out can point to any of the elements with the key
+    ok = ok && (!out_ptr || (out && (out->ptr == expected ||
+                                     (!absent && out->ptr->key == obj->key &&
+                                      ptree_get_multiset__simple_obj(t)))));
+  }
+  return ok && same_content(t, s);
+}
+
+bool test_insert_or_get() {
+  feature_test<> test;
+  bool ok = check_insert_or_get(test);
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  feature_test<obj_multiset> multiset_test(NUM_FEATURE_OBJS / 16);
+  ptree_set_multiset__simple_obj(multiset_test.t, 1);
+  multiset_test.fill();
+  ok = check_insert_or_get(multiset_test) && ok;
+#endif
+  // the first element of an empty tree, then an element equal to it, and its
+  // key, for which nothing is made
+  ptree_of_simple_obj *small = new_tree();
+  simple_obj objs[] = {probe(1), probe(1)};
+  obj_maker maker;
+  maker.pool.resize(1);
+  maker.made = 0;
+  ptree_of_simple_obj_it *out = NULL;
+  ok = ok && ptree_insert_or_get__simple_obj(small, &objs[0], &out) &&
+       out && out->ptr == &objs[0];
+  out = NULL;
+  ok = ok && !ptree_insert_or_get__simple_obj(small, &objs[1], &out) && out &&
+       out->ptr == &objs[0];
+  out = NULL;
+  ok = ok &&
+       !ptree_insert_or_get_by_key__simple_obj(small, &objs[1].key,
+                                               make_simple_obj, &maker, &out) &&
+       maker.made == 0 && out && out->ptr == &objs[0] &&
+       same_content(small, obj_set{&objs[0]});
+  ptree_free__simple_obj(small);
+  return report("ptree_insert_or_get and ptree_insert_or_get_by_key", ok);
+}
+
+#if (PTREE_NO_PARENT_POINTERS == 0)
+
+bool test_multiset() {
+  // few distinct keys, so that each key has many elements
+  feature_test<obj_multiset> test(NUM_FEATURE_OBJS / 16);
+  ptree_of_simple_obj *t = test.t;
+  obj_multiset &s = test.s;
+  ptree_set_multiset__simple_obj(t, 1);
+  bool ok = true;
+  // std::multiset also inserts each element after the ones equal to it
+  for (auto &obj : test.objs) {
+    s.insert(&obj);
+    ok = ok && ptree_insert__simple_obj(t, &obj) == 1;
+  }
+  ok = ok && same_content(t, s);
+  for (int i = 0; i < 1000 && ok; ++i) {
+    int key = test.rng.next();
+    simple_obj key_probe = probe(key);
+    auto range = s.equal_range(&key_probe);
+    ptree_of_simple_obj_it *begin;
+    ptree_of_simple_obj_it *end;
+    ptree_equal_range__simple_obj(t, &key, &begin, &end);
+    ok = ptree_count__simple_obj(t, &key) == s.count(&key_probe) &&
+         (range.first == range.second ? begin == end
+                                      : begin && begin->ptr == *range.first) &&
+         (range.second == s.end() ? !end : end && end->ptr == *range.second);
+  }
+  // removes a given element, the first one with a key, and all of them
+  for (int i = 0; i < 1000 && ok; ++i) {
+    simple_obj *obj = &test.objs[test.rng.next() % NUM_FEATURE_OBJS];
+    auto range = s.equal_range(obj);
+    auto x = find(range.first, range.second, obj);
+    ok = ptree_remove__simple_obj(t, obj) == (x != range.second);
+    if (x != range.second) {
+      s.erase(x);
+    }
+    int key = test.rng.next();
+    simple_obj key_probe = probe(key);
+    range = s.equal_range(&key_probe);
+    ok = ok && ptree_remove_by_key__simple_obj(t, &key) ==
+                   (range.first != range.second);
+    if (range.first != range.second) {
+      s.erase(range.first);
+    }
+    if (i % 10 == 0) {
+      key = test.rng.next();
+      key_probe = probe(key);
+      ok = ok && ptree_remove_all_by_key__simple_obj(t, &key) ==
+                     s.erase(&key_probe);
+    }
+  }
+  ok = ok && same_content(t, s);
+  // removes every other element through iterators, also among equal ones
+  ptree_of_simple_obj_it *it = ptree_min__simple_obj(t);
+  auto expected = s.begin();
+  for (bool remove = false; it && ok; remove = !remove) {
+    ok = expected != s.end() && it->ptr == *expected;
+    if (remove) {
+      it = ptree_remove_by_it__simple_obj(t, it);
+      expected = s.erase(expected);
+    } else {
+      it = ptree_it_next__simple_obj(it);
+      ++expected;
+    }
+  }
+  ok = ok && same_content(t, s);
+  // an empty multiset, then one whose elements all have the same key
+  ptree_of_simple_obj *same = new_tree();
+  ptree_set_multiset__simple_obj(same, 1);
+  vector<simple_obj> twins(100, probe(1));
+  int key = 1;
+  ptree_of_simple_obj_it *begin;
+  ptree_of_simple_obj_it *end;
+  ptree_equal_range__simple_obj(same, &key, &begin, &end);
+  ok = ok && !begin && !end && ptree_count__simple_obj(same, &key) == 0 &&
+       ptree_remove_all_by_key__simple_obj(same, &key) == 0;
+  for (auto &twin : twins) {
+    ok = ok && ptree_insert__simple_obj(same, &twin);
+  }
+  ptree_equal_range__simple_obj(same, &key, &begin, &end);
+  ok = ok && begin && begin->ptr == &twins[0] && !end &&
+       ptree_count__simple_obj(same, &key) == twins.size() &&
+       ptree_remove_by_key__simple_obj(same, &key) &&
+       ptree_min__simple_obj(same)->ptr == &twins[1] &&
+       ptree_remove_all_by_key__simple_obj(same, &key) == twins.size() - 1 &&
+       same_content(same, obj_multiset());
+  ptree_free__simple_obj(same);
+  return report("multiset", ok);
+}
+
+#endif
+
+// drains the tree with ptree_pop_min, ptree_pop_max or both, inserting some
+// objects back along the way, and checks each popped element, and the cached
+// minimum and maximum, against the set
+bool test_pop() {
+  feature_test<> test;
+  ptree_of_simple_obj *t = test.t;
+  obj_set &s = test.s;
+  bool ok = !ptree_pop_min__simple_obj(t) && !ptree_pop_max__simple_obj(t);
+  for (int round = 0; round < 3 && ok; ++round) {
+    test.fill();
+    for (int i = 0; !s.empty() && ok; ++i) {
+      bool max = round == 1 || (round == 2 && test.rng.next() % 2);
+      auto x = max ? prev(s.end()) : s.begin();
+      simple_obj *expected = *x;
+      s.erase(x);
+      ok = (max ? ptree_pop_max__simple_obj(t)
+                : ptree_pop_min__simple_obj(t)) == expected;
+      if (i % 4 == 0) {
+        simple_obj *obj = &test.objs[test.rng.next() % NUM_FEATURE_OBJS];
+        ok = ok &&
+             ptree_insert__simple_obj(t, obj) == (int)s.insert(obj).second;
+      }
+      if (i % 1000 == 0) {
+        ok = ok && same_content(t, s);
+      }
+    }
+    ok = ok && same_content(t, s) && !ptree_pop_min__simple_obj(t) &&
+         !ptree_pop_max__simple_obj(t);
+  }
+  // the only element of a tree is both its minimum and its maximum
+  for (int max = 0; max < 2 && ok; ++max) {
+    ptree_insert__simple_obj(t, &test.objs[0]);
+    ok = (max ? ptree_pop_max__simple_obj(t) : ptree_pop_min__simple_obj(t)) ==
+             &test.objs[0] &&
+         same_content(t, s);
+  }
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  // equal elements are popped from the first inserted by ptree_pop_min, and
+  // from the last inserted by ptree_pop_max
+  feature_test<obj_multiset> multiset_test(NUM_FEATURE_OBJS / 16);
+  ptree_set_multiset__simple_obj(multiset_test.t, 1);
+  multiset_test.fill();
+  obj_multiset &ms = multiset_test.s;
+  for (int i = 0; !ms.empty() && ok; ++i) {
+    bool max = i % 2;
+    auto x = max ? prev(ms.end()) : ms.begin();
+    simple_obj *expected = *x;
+    ms.erase(x);
+    ok = (max ? ptree_pop_max__simple_obj(multiset_test.t)
+              : ptree_pop_min__simple_obj(multiset_test.t)) == expected;
+  }
+  ok = ok && same_content(multiset_test.t, ms);
+#endif
+  return report("ptree_pop_min and ptree_pop_max", ok);
+}
+
+// inserts all the objects of the test in a tree with the given capacity, and
+// checks each evicted element against the set
+template <class set_type>
+bool check_insert_evict(feature_test<set_type> &test, size_t capacity,
+                        int evict_max) {
+  ptree_set_capacity__simple_obj(test.t, capacity, evict_max);
+  bool ok = true;
+  for (auto &obj : test.objs) {
+    simple_obj *expected = NULL;
+    auto x = test.s.insert(&obj);
+    if (!inserted(x)) {
+      expected = &obj;
+    } else if (test.s.size() > capacity) {
+      auto victim = evict_max ? prev(test.s.end()) : test.s.begin();
+      expected = *victim;
+      test.s.erase(victim);
+    }
+    ok = ok && ptree_insert_evict__simple_obj(test.t, &obj) == expected;
+  }
+  return ok && same_content(test.t, test.s);
+}
+
+bool test_insert_evict() {
+  bool ok = true;
+  for (int evict_max = 0; evict_max < 2; ++evict_max) {
+    // a capacity of 1 evicts on each insertion of a new element
+    size_t capacities[] = {1, 1000};
+    for (size_t capacity : capacities) {
+      feature_test<> test;
+      ok = check_insert_evict(test, capacity, evict_max) && ok;
+    }
+#if (PTREE_NO_PARENT_POINTERS == 0)
+    // equal elements go after each other, so a new element equal to the
+    // maximum is evicted right away, and one equal to the minimum is not
+    feature_test<obj_multiset> multiset_test(NUM_FEATURE_OBJS / 16);
+    ptree_set_multiset__simple_obj(multiset_test.t, 1);
+    ok = check_insert_evict(multiset_test, 1000, evict_max) && ok;
+#endif
+  }
+  return report("ptree_insert_evict", ok);
+}
+
+bool test_range_removal() {
+  feature_test<> test;
+  ptree_of_simple_obj *t = test.t;
+  obj_set &s = test.s;
+  // an empty tree has nothing to remove
+  int key = 0;
+  bool ok = ptree_remove_range__simple_obj(t, NULL, NULL) == 0 &&
+            ptree_remove_less_than__simple_obj(t, &key) == 0 &&
+            ptree_remove_greater_than__simple_obj(t, &key) == 0;
+  // a single element tree, around its only element, then on it
+  ptree_insert__simple_obj(t, &test.objs[0]);
+  key = test.objs[0].key;
+  int before = key - 1;
+  int after = key + 1;
+  ok = ok && ptree_remove_range__simple_obj(t, &after, NULL) == 0 &&
+       ptree_remove_range__simple_obj(t, NULL, &before) == 0 &&
+       ptree_remove_less_than__simple_obj(t, &key) == 0 &&
+       ptree_remove_greater_than__simple_obj(t, &key) == 0 &&
+       ptree_has__simple_obj(t, &test.objs[0]) &&
+       ptree_remove_range__simple_obj(t, &key, &key) == 1 && same_content(t, s);
+  for (int round = 0; round < 40 && ok; ++round) {
+    test.fill();
+    // even rounds remove a few elements, odd ones about half of the tree
+    int min_key = test.rng.next();
+    int width = round % 2 ? NUM_FEATURE_OBJS / 2 : NUM_FEATURE_OBJS / 1000;
+    if (round % 2) {
+      min_key /= 4;
+    }
+    int max_key = min_key + width;
+    simple_obj min_probe = probe(min_key);
+    simple_obj max_probe = probe(max_key);
+    auto first = s.lower_bound(&min_probe);
+    auto last = s.upper_bound(&max_probe);
+    // every fourth round, one of the sides is unbounded
+    const int *min_ptr = &min_key;
+    const int *max_ptr = &max_key;
+    if (round % 4 == 1) {
+      min_ptr = NULL;
+      first = s.begin();
+    } else if (round % 4 == 3) {
+      max_ptr = NULL;
+      last = s.end();
+    }
+    size_t expected = distance(first, last);
+    s.erase(first, last);
+    ok = ptree_remove_range__simple_obj(t, min_ptr, max_ptr) == expected &&
+         same_content(t, s);
+  }
+  // inverted bounds remove nothing
+  int min_key = NUM_FEATURE_OBJS / 2;
+  int max_key = min_key - 1;
+  ok = ok && ptree_remove_range__simple_obj(t, &min_key, &max_key) == 0 &&
+       same_content(t, s);
+  // strict bounds
+  for (int round = 0; round < 4 && ok; ++round) {
+    test.fill();
+    int offset = test.rng.next() / 16;
+    key = round < 2 ? offset : NUM_FEATURE_OBJS - offset;
+    simple_obj key_probe = probe(key);
+    size_t removed;
+    size_t expected;
+    if (round % 2) {
+      auto first = s.upper_bound(&key_probe);
+      expected = distance(first, s.end());
+      s.erase(first, s.end());
+      removed = ptree_remove_greater_than__simple_obj(t, &key);
+    } else {
+      auto last = s.lower_bound(&key_probe);
+      expected = distance(s.begin(), last);
+      s.erase(s.begin(), last);
+      removed = ptree_remove_less_than__simple_obj(t, &key);
+    }
+    ok = removed == expected && same_content(t, s);
+  }
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  // in a multiset, with many elements for each key
+  feature_test<obj_multiset> multiset_test(NUM_FEATURE_OBJS / 16);
+  ptree_set_multiset__simple_obj(multiset_test.t, 1);
+  for (int round = 0; round < 10 && ok; ++round) {
+    for (auto &obj : multiset_test.objs) {
+      if (!ptree_has__simple_obj(multiset_test.t, &obj)) {
+        multiset_test.s.insert(&obj);
+        ptree_insert__simple_obj(multiset_test.t, &obj);
+      }
+    }
+    // even rounds remove a single key, odd ones a range
+    int min_key = multiset_test.rng.next();
+    int max_key = min_key + (round % 2 ? NUM_FEATURE_OBJS / 32 : 0);
+    simple_obj min_probe = probe(min_key);
+    simple_obj max_probe = probe(max_key);
+    auto first = multiset_test.s.lower_bound(&min_probe);
+    auto last = multiset_test.s.upper_bound(&max_probe);
+    size_t expected = distance(first, last);
+    multiset_test.s.erase(first, last);
+    ok = ptree_remove_range__simple_obj(multiset_test.t, &min_key, &max_key) ==
+             expected &&
+         same_content(multiset_test.t, multiset_test.s);
+  }
+#endif
+  return report("ptree_remove_range, ptree_remove_less_than and "
+                "ptree_remove_greater_than",
+                ok);
+}
+
+// removes sorted batches of random keys, which may repeat, and checks the
+// number of removed elements and the content against the set
+template <class set_type>
+bool check_remove_many(feature_test<set_type> &test, size_t num_keys) {
+  vector<int> keys(num_keys);
+  for (auto &key : keys) {
+    key = test.rng.next();
+  }
+  // a few keys out of the range of the tree
+  if (num_keys > 2) {
+    keys[0] = -1;
+    keys[1] = NUM_FEATURE_OBJS + 1;
+  }
+  sort(keys.begin(), keys.end());
+  vector<const void *> key_ptrs;
+  size_t expected = 0;
+  for (auto &key : keys) {
+    key_ptrs.push_back(&key);
+    // each key removes the first element with it, as ptree_remove_by_key
+    simple_obj key_probe = probe(key);
+    auto x = test.s.lower_bound(&key_probe);
+    if (x != test.s.end() && (*x)->key == key) {
+      test.s.erase(x);
+      ++expected;
+    }
+  }
+  return ptree_remove_many__simple_obj(test.t, key_ptrs.data(), num_keys) ==
+             expected &&
+         same_content(test.t, test.s);
+}
+
+bool test_remove_many() {
+  feature_test<> test;
+  // an empty tree, and a single element tree, with a key before its element,
+  // its key twice, and a key after it
+  bool ok = check_remove_many(test, 0);
+  int key = test.objs[0].key;
+  int keys[] = {key, key - 1, key, key, key + 1};
+  const void *key_ptrs[] = {&keys[0], &keys[1], &keys[2], &keys[3], &keys[4]};
+  ok = ok && ptree_remove_many__simple_obj(test.t, key_ptrs, 1) == 0;
+  ptree_insert__simple_obj(test.t, &test.objs[0]);
+  ok = ok && ptree_remove_many__simple_obj(test.t, key_ptrs + 1, 4) == 1 &&
+       same_content(test.t, test.s);
+  for (int round = 0; round < 20 && ok; ++round) {
+    test.fill();
+    // most rounds remove small batches, which are located in the tree, and
+    // every fourth one a batch as large as the tree, which walks the tree and
+    // the keys together
+    size_t sizes[] = {0, 1, 16, 1000};
+    size_t num_keys = round % 4 == 3 ? test.s.size() : sizes[round % 4];
+    ok = check_remove_many(test, num_keys);
+  }
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  // in a multiset, repeated keys remove the elements with the key in order
+  feature_test<obj_multiset> multiset_test(NUM_FEATURE_OBJS / 16);
+  ptree_set_multiset__simple_obj(multiset_test.t, 1);
+  multiset_test.fill();
+  for (int round = 0; round < 20 && ok; ++round) {
+    ok = check_remove_many(multiset_test, round % 4 == 3 ? 20000 : 2000);
+  }
+#endif
+  return report("ptree_remove_many", ok);
+}
+
+// checks that the destructor was called once for each object of the set, and
+// never for the others
+template <class set_type>
+bool destroyed_once(const destroy_log &log, const set_type &s) {
+  for (size_t i = 0; i < log.calls.size(); ++i) {
+    bool contained = false;
+    for (auto x = s.equal_range(log.first + i); x.first != x.second;
+         ++x.first) {
+      contained = contained || *x.first == log.first + i;
+    }
+    if (log.calls[i] != (int)contained) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool test_clear_with() {
+  feature_test<> test;
+  destroy_log log;
+  log.first = test.objs.data();
+  // an empty tree, then a single element tree
+  log.calls.assign(test.objs.size(), 0);
+  ptree_clear_with__simple_obj(test.t, log_destroy, &log);
+  bool ok = destroyed_once(log, test.s) && same_content(test.t, test.s);
+  obj_set single = {&test.objs[0]};
+  ptree_insert__simple_obj(test.t, &test.objs[0]);
+  ptree_clear_with__simple_obj(test.t, log_destroy, &log);
+  ok = ok && destroyed_once(log, single) && same_content(test.t, test.s);
+  for (int round = 0; round < 3 && ok; ++round) {
+    test.fill();
+    log.calls.assign(test.objs.size(), 0);
+    ptree_clear_with__simple_obj(test.t, log_destroy, &log);
+    ok = destroyed_once(log, test.s);
+    // the tree is empty and can be filled again
+    test.s.clear();
+    ok = ok && same_content(test.t, test.s);
+  }
+  // ptree_free_with on a tree with some elements removed
+  ptree_of_simple_obj *t = new_tree();
+  test.fill();
+  for (auto &obj : test.objs) {
+    ptree_insert__simple_obj(t, &obj);
+  }
+  for (int i = 0; i < NUM_FEATURE_OBJS / 2; ++i) {
+    int key = test.rng.next();
+    simple_obj key_probe = probe(key);
+    ptree_remove_by_key__simple_obj(t, &key);
+    test.s.erase(&key_probe);
+  }
+  ok = ok && same_content(t, test.s);
+  log.calls.assign(test.objs.size(), 0);
+  ptree_free_with__simple_obj(t, log_destroy, &log);
+  ok = ok && destroyed_once(log, test.s);
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  // equal elements of a multiset are each visited once
+  feature_test<obj_multiset> multiset_test(NUM_FEATURE_OBJS / 16);
+  ptree_set_multiset__simple_obj(multiset_test.t, 1);
+  multiset_test.fill();
+  log.first = multiset_test.objs.data();
+  log.calls.assign(multiset_test.objs.size(), 0);
+  ptree_clear_with__simple_obj(multiset_test.t, log_destroy, &log);
+  ok = ok && destroyed_once(log, multiset_test.s);
+#endif
+  return report("ptree_clear_with and ptree_free_with", ok);
+}
+
+// removes the objects whose key is a multiple of divisor, and checks the
+// number of removed elements and the content against the set
+template <class set_type>
+bool check_retain(feature_test<set_type> &test, int divisor) {
+  size_t expected = 0;
+  for (auto x = test.s.begin(); x != test.s.end();) {
+    if ((*x)->key % divisor == 0) {
+      x = test.s.erase(x);
+      ++expected;
+    } else {
+      ++x;
+    }
+  }
+  return ptree_retain__simple_obj(test.t, not_multiple_simple_obj,
+                                  &divisor) == expected &&
+         same_content(test.t, test.s);
+}
+
+bool test_retain() {
+  feature_test<> test;
+  // an empty tree, and a single element tree, which keeps its element and
+  // then drops it
+  bool ok = check_retain(test, 1);
+  simple_obj *obj = &test.objs[0];
+  while (obj->key == 0) {
+    ++obj;
+  }
+  test.s.insert(obj);
+  ptree_insert__simple_obj(test.t, obj);
+  ok = ok && check_retain(test, obj->key + 1) && test.s.size() == 1 &&
+       check_retain(test, 1);
+  int divisors[] = {2, 3, 100, NUM_FEATURE_OBJS + 1, 1};
+  for (int divisor : divisors) {
+    test.fill();
+    ok = ok && check_retain(test, divisor);
+  }
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  // in a multiset, all the elements with a key are kept or removed together
+  feature_test<obj_multiset> multiset_test(NUM_FEATURE_OBJS / 16);
+  ptree_set_multiset__simple_obj(multiset_test.t, 1);
+  for (int divisor : divisors) {
+    multiset_test.fill();
+    ok = ok && check_retain(multiset_test, divisor);
+  }
+#endif
+  return report("ptree_retain", ok);
+}
+
+bool test_update() {
+  feature_test<> test;
+  ptree_of_simple_obj *t = test.t;
+  obj_set &s = test.s;
+  // the only element of a tree stays in place whatever its new key
+  int new_key = NUM_FEATURE_OBJS + 1;
+  ptree_insert__simple_obj(t, &test.objs[0]);
+  ptree_of_simple_obj_it *it = ptree_max__simple_obj(t);
+  bool ok = ptree_update__simple_obj(t, it, &new_key, set_key_simple_obj,
+                                     &new_key) == it &&
+            ptree_min__simple_obj(t) == it &&
+            ptree_remove__simple_obj(t, &test.objs[0]);
+  // the index entries and the filter follow the keys of the updated elements
+  ptree_set_hash_index__simple_obj(t, hash_simple_obj, hash_key_simple_obj);
+  ptree_set_bloom_filter__simple_obj(t, hash_simple_obj, hash_key_simple_obj);
+  test.fill();
+  for (int i = 0; i < NUM_FEATURE_OBJS && ok; ++i) {
+    int key = test.rng.next();
+    simple_obj key_probe = probe(key);
+    auto x = s.find(&key_probe);
+    it = ptree_get_it__simple_obj(t, &key);
+    if (x == s.end()) {
+      ok = !it;
+      continue;
+    }
+    simple_obj *obj = *x;
+    ok = it && it->ptr == obj;
+    // iterations move the key, in turn, between the ones of the neighbours,
+    // which keeps the element in place, onto the key of a neighbour, which
+    // fails, and anywhere, which can fail too
+    new_key = test.rng.next();
+    if (i % 3 == 0) {
+      int low = x == s.begin() ? -1 : (*prev(x))->key;
+      int high = next(x) == s.end() ? NUM_FEATURE_OBJS + 1 : (*next(x))->key;
+      new_key = low + 1 + new_key % (high - low - 1);
+    } else if (i % 3 == 1 && next(x) != s.end()) {
+      new_key = (*next(x))->key;
+    } else if (i % 3 == 1 && x != s.begin()) {
+      new_key = (*prev(x))->key;
+    }
+    simple_obj new_probe = probe(new_key);
+    auto y = s.find(&new_probe);
+    bool collides = y != s.end() && *y != obj;
+    if (!collides) {
+      s.erase(x);
+    }
+    ptree_of_simple_obj_it *updated = ptree_update__simple_obj(
+        t, it, &new_key, set_key_simple_obj, &new_key);
+    if (collides) {
+      ok = ok && !updated && obj->key == key;
+    } else {
+      s.insert(obj);
+      ok = ok && updated == it && it->ptr == obj;
+    }
+    if (i % 1000 == 0) {
+      ok = ok && same_content(t, s);
+    }
+  }
+  ok = ok && same_content(t, s);
+  for (auto obj : s) {
+    ok = ok && ptree_get__simple_obj(t, &obj->key) == obj;
+  }
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  // in a multiset, updated elements go after the ones equal to them
+  feature_test<obj_multiset> multiset_test(NUM_FEATURE_OBJS / 16);
+  ptree_set_multiset__simple_obj(multiset_test.t, 1);
+  multiset_test.fill();
+  obj_multiset &ms = multiset_test.s;
+  for (int i = 0; i < NUM_FEATURE_OBJS && ok; ++i) {
+    simple_obj *obj =
+        &multiset_test.objs[multiset_test.rng.next() % NUM_FEATURE_OBJS];
+    auto x = find(ms.lower_bound(obj), ms.upper_bound(obj), obj);
+    ptree_of_simple_obj_it *it = ptree_has__simple_obj(multiset_test.t, obj);
+    ok = x != ms.end() && it && it->ptr == obj;
+    if (!ok) {
+      break;
+    }
+    // odd iterations set the key of a neighbour, if there is one
+    int new_key = multiset_test.rng.next();
+    if (i % 2 && next(x) != ms.end()) {
+      new_key = (*next(x))->key;
+    } else if (i % 2 && x != ms.begin()) {
+      new_key = (*prev(x))->key;
+    }
+    ms.erase(x);
+    ok = ok && ptree_update__simple_obj(multiset_test.t, it, &new_key,
+                                        set_key_simple_obj, &new_key) == it;
+    ms.insert(obj);
+    if (i % 1000 == 0) {
+      ok = ok && same_content(multiset_test.t, ms);
+    }
+  }
+  ok = ok && same_content(multiset_test.t, ms);
+#endif
+  return report("ptree_update", ok);
+}
+
+// moves random elements between two trees with ptree_extract and
+// ptree_insert_node, while inserting, removing and looking up others. The trees
+// have a hash index, a bloom filter and a lookup cache, which the moved nodes
+// have to leave and join.
+bool test_extract() {
+  feature_test<> tests[2];
+  for (auto &test : tests) {
+    ptree_set_hash_index__simple_obj(test.t, hash_simple_obj,
+                                     hash_key_simple_obj);
+    ptree_set_bloom_filter__simple_obj(test.t, hash_simple_obj,
+                                       hash_key_simple_obj);
+    ptree_set_lookup_cache__simple_obj(test.t, hash_key_simple_obj, 256);
+  }
+  // the objects of the first test are shared by both trees
+  vector<simple_obj> &objs = tests[0].objs;
+  random_int_generator &rng = tests[0].rng;
+  bool ok = true;
+  for (int i = 0; i < 10 * NUM_FEATURE_OBJS && ok; ++i) {
+    int from = rng.next() % 2;
+    ptree_of_simple_obj *t = tests[from].t;
+    obj_set &s = tests[from].s;
+    int key = rng.next();
+    simple_obj key_probe = probe(key);
+    auto x = s.find(&key_probe);
+    ptree_of_simple_obj_it *it = ptree_get_it__simple_obj(t, &key);
+    ok = x == s.end() ? !it : it && it->ptr == *x;
+    switch (rng.next() % 3) {
+    case 0: {
+      simple_obj *obj = &objs[rng.next() % NUM_FEATURE_OBJS];
+      ok = ok && ptree_insert__simple_obj(t, obj) == (int)s.insert(obj).second;
+      break;
+    }
+    case 1:
+      ok = ok && ptree_remove_by_key__simple_obj(t, &key) ==
+                     (int)s.erase(&key_probe);
+      break;
+    default:
+      // moves the element to the other tree, or frees its node if the other
+      // tree already has its key
+      if (it) {
+        simple_obj *obj = it->ptr;
+        ptree_of_simple_obj_node *node = ptree_extract__simple_obj(t, it);
+        s.erase(x);
+        ok = ok && node->ptr == obj;
+        ptree_of_simple_obj_it *moved =
+            ptree_insert_node__simple_obj(tests[!from].t, node);
+        if (tests[!from].s.insert(obj).second) {
+          ok = ok && moved && moved->ptr == obj;
+        } else {
+          ok = ok && !moved;
+          ptree_node_free__simple_obj(node);
+        }
+      }
+      break;
+    }
+  }
+  ok = ok && same_content(tests[0].t, tests[0].s) &&
+       same_content(tests[1].t, tests[1].s);
+  // the only element of a tree, moved to an empty tree and back
+  feature_test<> single;
+  simple_obj *obj = &single.objs[0];
+  ptree_of_simple_obj *empty = new_tree();
+  ptree_insert__simple_obj(single.t, obj);
+  for (int i = 0; i < 2 && ok; ++i) {
+    ptree_of_simple_obj *from = i ? empty : single.t;
+    ptree_of_simple_obj *to = i ? single.t : empty;
+    ptree_of_simple_obj_it *moved = ptree_insert_node__simple_obj(
+        to, ptree_extract__simple_obj(from, ptree_min__simple_obj(from)));
+    ok = moved && moved->ptr == obj && !ptree_min__simple_obj(from) &&
+         ptree_min__simple_obj(to) == moved &&
+         ptree_max__simple_obj(to) == moved;
+  }
+  ptree_free__simple_obj(empty);
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  // in a multiset, a node moved next to equal elements goes after them
+  feature_test<obj_multiset> multiset_tests[2];
+  for (auto &test : multiset_tests) {
+    ptree_set_multiset__simple_obj(test.t, 1);
+    test.fill();
+  }
+  for (int i = 0; i < NUM_FEATURE_OBJS && ok; ++i) {
+    int from = multiset_tests[0].rng.next() % 2;
+    obj_multiset &s = multiset_tests[from].s;
+    if (s.empty()) {
+      continue;
+    }
+    auto x = s.begin();
+    advance(x, multiset_tests[0].rng.next() % min(s.size(), (size_t)16));
+    simple_obj *moved_obj = *x;
+    ptree_of_simple_obj_it *it =
+        ptree_has__simple_obj(multiset_tests[from].t, moved_obj);
+    s.erase(x);
+    multiset_tests[!from].s.insert(moved_obj);
+    ptree_of_simple_obj_it *moved = ptree_insert_node__simple_obj(
+        multiset_tests[!from].t,
+        ptree_extract__simple_obj(multiset_tests[from].t, it));
+    ok = moved && moved->ptr == moved_obj;
+  }
+  ok = ok && same_content(multiset_tests[0].t, multiset_tests[0].s) &&
+       same_content(multiset_tests[1].t, multiset_tests[1].s);
+#endif
+  return report("ptree_extract and ptree_insert_node", ok);
+}
+
+// clones a tree with a hash index, a bloom filter and a lookup cache, and
+// checks that the clone has the same content and settings, and that the two
+// change independently
+bool test_clone() {
+  feature_test<> test;
+  ptree_of_simple_obj *t = test.t;
+  ptree_set_hash_index__simple_obj(t, hash_simple_obj, hash_key_simple_obj);
+  ptree_set_bloom_filter__simple_obj(t, hash_simple_obj, hash_key_simple_obj);
+  ptree_set_lookup_cache__simple_obj(t, hash_key_simple_obj, 256);
+  // an empty tree, and a single element tree
+  ptree_of_simple_obj *clone = ptree_clone__simple_obj(t);
+  bool ok = same_content(clone, test.s);
+  ptree_free__simple_obj(clone);
+  ptree_insert__simple_obj(t, &test.objs[0]);
+  clone = ptree_clone__simple_obj(t);
+  obj_set single = {&test.objs[0]};
+  ok = ok && same_content(clone, single) &&
+       ptree_remove__simple_obj(clone, &test.objs[0]) &&
+       same_content(clone, test.s) && same_content(t, single);
+  ptree_free__simple_obj(clone);
+  ptree_remove__simple_obj(t, &test.objs[0]);
+  test.fill();
+  clone = ptree_clone__simple_obj(t);
+  obj_set clone_set = test.s;
+  ok = ok && same_content(clone, clone_set);
+  for (int i = 0; i < NUM_FEATURE_OBJS && ok; ++i) {
+    int key = test.rng.next();
+    simple_obj key_probe = probe(key);
+    ok = ptree_remove_by_key__simple_obj(clone, &key) ==
+             (int)clone_set.erase(&key_probe) &&
+         !ptree_get_it__simple_obj(clone, &key);
+    simple_obj *obj = &test.objs[test.rng.next() % NUM_FEATURE_OBJS];
+    ok = ok && (ptree_get__simple_obj(clone, &obj->key) != NULL) ==
+                   (clone_set.count(obj) != 0);
+  }
+  ok = ok && same_content(clone, clone_set) && same_content(t, test.s);
+  ptree_free__simple_obj(clone);
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  feature_test<obj_multiset> multiset_test(NUM_FEATURE_OBJS / 16);
+  ptree_set_multiset__simple_obj(multiset_test.t, 1);
+  multiset_test.fill();
+  clone = ptree_clone__simple_obj(multiset_test.t);
+  ok = ok && ptree_get_multiset__simple_obj(clone) &&
+       same_content(clone, multiset_test.s);
+  ptree_free__simple_obj(clone);
+#endif
+  return report("ptree_clone", ok);
+}
+
+bool test_merge() {
+  const int num_trees = 5;
+  // few distinct keys, so that the trees have many keys in common
+  random_int_generator rng(NUM_FEATURE_OBJS / 4);
+  vector<simple_obj> objs = make_objs(NUM_FEATURE_OBJS, rng);
+  ptree_of_simple_obj *trees[num_trees];
+  // the elements of all trees, sorted by key and then by tree, as the merge
+  // returns them without dedup
+  vector<pair<int, simple_obj *>> all;
+  for (int i = 0; i < num_trees; ++i) {
+    trees[i] = new_tree();
+  }
+  for (int i = 0; i < NUM_FEATURE_OBJS; ++i) {
+    // the last tree stays empty
+    int tree = i % (num_trees - 1);
+    if (ptree_insert__simple_obj(trees[tree], &objs[i])) {
+      all.push_back(make_pair(tree, &objs[i]));
+    }
+  }
+  stable_sort(all.begin(), all.end(),
+              [](const pair<int, simple_obj *> &a,
+                 const pair<int, simple_obj *> &b) {
+                return a.second->key < b.second->key ||
+                       (a.second->key == b.second->key && a.first < b.first);
+              });
+  bool ok = true;
+  for (int dedup = 0; dedup < 2; ++dedup) {
+    ptree_merge *merge = ptree_merge_new__simple_obj(trees, num_trees, dedup);
+    simple_obj *last = NULL;
+    for (auto &x : all) {
+      if (dedup && last && last->key == x.second->key) {
+        continue;
+      }
+      last = x.second;
+      ok = ok && ptree_merge_next__simple_obj(merge) == x.second;
+    }
+    ok = ok && !ptree_merge_next__simple_obj(merge);
+    ptree_merge_free(merge);
+  }
+  // no trees, and only empty trees
+  ptree_merge *merge = ptree_merge_new__simple_obj(NULL, 0, 0);
+  ok = ok && !ptree_merge_next__simple_obj(merge);
+  ptree_merge_free(merge);
+  merge = ptree_merge_new__simple_obj(trees + num_trees - 1, 1, 0);
+  ok = ok && !ptree_merge_next__simple_obj(merge);
+  ptree_merge_free(merge);
+  // a single element tree, alone and with an empty tree, on either side
+  ptree_of_simple_obj *single = new_tree();
+  ptree_insert__simple_obj(single, &objs[0]);
+  ptree_of_simple_obj *pairs[][2] = {{single, trees[num_trees - 1]},
+                                     {trees[num_trees - 1], single}};
+  for (int i = 0; i < 3; ++i) {
+    merge = i ? ptree_merge_new__simple_obj(pairs[i - 1], 2, 1)
+              : ptree_merge_new__simple_obj(&single, 1, 1);
+    ok = ok && ptree_merge_next__simple_obj(merge) == &objs[0] &&
+         !ptree_merge_next__simple_obj(merge);
+    ptree_merge_free(merge);
+  }
+  ptree_free__simple_obj(single);
+  for (int i = 0; i < num_trees; ++i) {
+    ptree_free__simple_obj(trees[i]);
+  }
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  // multisets, whose equal elements come in the order of each tree, and are
+  // all skipped after the first one with dedup
+  feature_test<obj_multiset> multiset_tests[2];
+  ptree_of_simple_obj *multisets[2];
+  vector<simple_obj *> merged;
+  for (int i = 0; i < 2; ++i) {
+    ptree_set_multiset__simple_obj(multiset_tests[i].t, 1);
+    multiset_tests[i].fill();
+    multisets[i] = multiset_tests[i].t;
+  }
+  for (auto *obj : multiset_tests[0].s) {
+    merged.push_back(obj);
+  }
+  for (auto *obj : multiset_tests[1].s) {
+    merged.push_back(obj);
+  }
+  // stable, so equal elements stay in the order of the trees
+  stable_sort(merged.begin(), merged.end(),
+              [](const simple_obj *a, const simple_obj *b) {
+                return a->key < b->key;
+              });
+  for (int dedup = 0; dedup < 2; ++dedup) {
+    merge = ptree_merge_new__simple_obj(multisets, 2, dedup);
+    simple_obj *last = NULL;
+    for (auto *obj : merged) {
+      if (dedup && last && last->key == obj->key) {
+        continue;
+      }
+      last = obj;
+      ok = ok && ptree_merge_next__simple_obj(merge) == obj;
+    }
+    ok = ok && !ptree_merge_next__simple_obj(merge);
+    ptree_merge_free(merge);
+  }
+#endif
+  return report("ptree_merge", ok);
+}
+
 int main() {
 
   cout << "this test inserts and remove the same objects from a ptree and a "
@@ -112,92 +1930,75 @@ int main() {
     ptree_insert__simple_obj(t, &objs[i]);
   }
 
-  vector<int> set_inorder;
-  vector<int> tree_inorder;
-  set_inorder.reserve(NUM_OBJS);
-  tree_inorder.reserve(NUM_OBJS);
-
-  for (auto *x : s) {
-    set_inorder.push_back(x->key);
-  }
-
-  ptree_of_simple_obj_it *it = ptree_min__simple_obj(t);
-  while (it) {
-    tree_inorder.push_back(it->ptr->key);
-    it = ptree_it_next__simple_obj(it);
-  }
-
   cout << "checking coherence after insertion" << endl;
-  cout << "size... " << endl;
-  cout << "std::set " << s.size() << endl;
-  cout << "ptree " << ptree_size__simple_obj(t) << endl;
-  cout << ((s.size() == ptree_size__simple_obj(t)) ? "...is the same"
-                                                   : "NOT the same!")
-       << endl;
-
-  assert(set_inorder.size() == tree_inorder.size());
-  cout << "checking element by element (order)..." << endl;
-  bool ok = true;
-  for (int i = 0; i < set_inorder.size(); ++i) {
-    if (tree_inorder[i] != set_inorder[i]) {
-      cout << "order error!" << endl;
-      for (int j = 0; j < set_inorder.size(); ++j) {
-        cout << set_inorder[j] << " " << tree_inorder[j] << endl;
-      }
-      ok = false;
-      break;
-    }
-  }
+  bool ok = check_same(t, s);
   if (ok) {
     cout << "...insertion is ok" << endl << endl;
   }
 
   cout << "creating " << NUM_OBJS
-       << " simple objects with random keys to insert," << endl;
-  objs.clear();
-  
+       << " simple objects with random keys to remove," << endl;
+  vector<simple_obj> to_remove;
+  to_remove.reserve(NUM_OBJS);
   for (int i = 0; i < NUM_OBJS; ++i) {
-    objs.push_back(simple_obj());
-    objs.back().key = rng.next();
+    to_remove.push_back(simple_obj());
+    to_remove.back().key = rng.next();
   }
 
   cout << "removing the simple objects" << endl;
 
   for (int i = 0; i < NUM_OBJS; ++i) {
-    s.erase(&objs[i]);
+    s.erase(&to_remove[i]);
   }
 
   for (int i = 0; i < NUM_OBJS; ++i) {
-    ptree_remove__simple_obj(t, &objs[i]);
+    ptree_remove__simple_obj(t, &to_remove[i]);
   }
 
   std::cout << "checking coherence after delation" << endl;
-  cout << "size... " << endl;
-  cout << "std::set " << s.size() << endl;
-  cout << "ptree " << ptree_size__simple_obj(t) << endl;
-  cout << ((s.size() == ptree_size__simple_obj(t)) ? "...is the same"
-                                                   : "NOT the same!")
-       << endl;
-
-  assert(set_inorder.size() == tree_inorder.size());
-  cout << "checking element by element (order)..." << endl;
-  ok = true;
-  for (int i = 0; i < set_inorder.size(); ++i) {
-    if (tree_inorder[i] != set_inorder[i]) {
-      cout << "order error!" << endl;
-      for (int j = 0; j < set_inorder.size(); ++j) {
-        cout << set_inorder[j] << " " << tree_inorder[j] << endl;
-      }
-      ok = false;
-      break;
-    }
-  }
-  if (ok) {
+  if (check_same(t, s)) {
     cout << "...delation is ok" << endl << endl;
+  } else {
+    ok = false;
   }
+  ptree_free__simple_obj(t);
+
+  cout << "testing the single features on " << NUM_FEATURE_OBJS
+       << " simple objects" << endl;
+  ok = test_shrink() && ok;
+  ok = test_get_many() && ok;
+  ok = test_get_many_sorted() && ok;
+  ok = test_insert_hint() && ok;
+  ok = test_finger_search() && ok;
+  ok = test_lookup_cache() && ok;
+  ok = test_hash_index() && ok;
+  ok = test_bloom_filter() && ok;
+  ok = test_learned_index() && ok;
+#if (PTREE_NO_PARENT_POINTERS == 0 || PTREE_THREADED == 1)
+  ok = test_it_steps() && ok;
+#endif
+  ok = test_small_removals() && ok;
+  ok = test_foreach() && ok;
+  ok = test_export() && ok;
+  ok = test_remove_by_it() && ok;
+  ok = test_insert_or_get() && ok;
+#if (PTREE_NO_PARENT_POINTERS == 0)
+  ok = test_multiset() && ok;
+#endif
+  ok = test_pop() && ok;
+  ok = test_insert_evict() && ok;
+  ok = test_range_removal() && ok;
+  ok = test_remove_many() && ok;
+  ok = test_clear_with() && ok;
+  ok = test_retain() && ok;
+  ok = test_update() && ok;
+  ok = test_extract() && ok;
+  ok = test_clone() && ok;
+  ok = test_merge() && ok;
+  cout << endl;
 
-  cout << "test completed" << endl;
+  cout << (ok ? "test completed" : "test FAILED") << endl;
 
   cin.get();
-  return 0;
+  return ok ? 0 : 1;
 }